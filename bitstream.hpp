@@ -141,6 +141,9 @@ std::size_t clz(utils::range<bit_iterator<I>>& a) {
   return n;
 }
 
+template<typename I>
+I find_startcode_prefix(I begin, I end);
+
 template<typename I>
 class bit_parser {
   std::uint32_t accumulator = 0;
@@ -200,6 +203,21 @@ public:
     return t;
   }
 
+  // Moves a byte aligned parser to the next 00 00 01 prefix or to the end of the data with
+  // a start code search over the underlying bytes, returns the bytes skipped.
+  friend utils::range<I> skip_to_next_start_code(bit_parser& bits) {
+    assert(byte_aligned(bits));
+
+    auto first = bits.begin().base();
+    auto i = find_startcode_prefix(first, bits.last.base());
+
+    bits.pos = i;
+    bits.accumulator = 0;
+    bits.unused = 32;
+
+    return utils::make_range(first, i);
+  }
+
   friend std::size_t clz(bit_parser& bits) {
     for(;;) {
       unsigned n = __builtin_clz(bits.accumulator);
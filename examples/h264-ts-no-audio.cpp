@@ -42,6 +42,8 @@ int main(int argc, char* argv[]) {
             push(decoder, ts, utils::tag<media::h264::annexb::access_unit_tag>(data(std::move(p))));
             next();
           }
+          else
+            flush(decoder);
         });
       });
     });
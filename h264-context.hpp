@@ -19,12 +19,18 @@ struct context : h264::decoded_picture_buffer<FrameBuffer> {
     auto h = parse_nal_unit_header(parser);
 
     switch(static_cast<nalu_type>(h.nal_unit_type)) {
-    case nalu_type::seq_parameter_set:
-      add(params, parse_sps(parser));
-      break;
-    case nalu_type::pic_parameter_set:
-      add(params, parse_pps(params, parser));
-      break;
+    // parameter sets repeated with the same content are not parsed again
+    case nalu_type::seq_parameter_set: {
+      auto hash = parameter_set_hash(nalu.begin(), nalu.end());
+      auto id = parser;
+      u(id, 24);
+      if(!params.has_sps(ue(id), hash)) add(params, parse_sps(parser), hash);
+      break; }
+    case nalu_type::pic_parameter_set: {
+      auto hash = parameter_set_hash(nalu.begin(), nalu.end());
+      auto id = parser;
+      if(!params.has_pps(ue(id), hash)) add(params, parse_pps(params, parser), hash);
+      break; }
     case nalu_type::access_unit_delimiter:
       recovery_point = false;
       break;
@@ -34,8 +40,8 @@ struct context : h264::decoded_picture_buffer<FrameBuffer> {
       break; }
     case nalu_type::slice_layer_non_idr:
     case nalu_type::slice_layer_idr: {
-      auto s = parse_slice_header(params, parser, h.nal_unit_type, h.nal_ref_idc);
-      if(s) on_slice(std::move(*s));
+      auto s = parse_slice_identity_header(params, parser, h.nal_unit_type, h.nal_ref_idc);
+      if(s) on_slice(*s, parser);
       break; }
     default:
       break;
@@ -62,31 +68,96 @@ struct context : h264::decoded_picture_buffer<FrameBuffer> {
   h264::slice_header const& slice() const { return *current_slice; }
   h264::seq_parameter_set const& sps() const { return *params.sps(slice()); }
   h264::pic_parameter_set const& pps() const { return *params.pps(slice()); }
+
+  // changes only when a parameter set really changes, for caches of values derived from them
+  std::uint32_t parameters_version() const { return params.version; }
+
+  // Trick play: only pictures starting with an I slice are decoded, the rest is dropped
+  // before reference marking and no decoded picture is kept as a reference. Leaving it
+  // empties the dpb and waits for an idr picture or a recovery point.
+  void set_intra_only(bool on) {
+    if(intra_only && !on) {
+      this->clear();
+      poc = utils::nullopt;
+      recovery_point = false;
+      last_slice = utils::nullopt;
+      marking_pending = false;
+    }
+    intra_only = on;
+    dropping = false;
+  }
+
+  bool is_intra_only() const { return intra_only; }
+
+  // Applies the reference marking of the current picture, otherwise done with the first slice
+  // of the next one, and stores it, so that the frames no longer used, the picture itself
+  // included, can be removed before the next picture. Called once the last slice of a frame
+  // or of the second field of a pair is pushed.
+  void store_current_picture() {
+    mark_current_picture();
+    this->decoded_picture_buffer<FrameBuffer>::store_current_picture();
+  }
 private:
-  void on_slice(h264::slice_header&& new_slice) {
-    new_pic_flag = !current_slice || are_different_pictures(*current_slice, new_slice);
+  // the rest of the slice header is parsed only for slices that are decoded
+  template<typename Parser>
+  void on_slice(h264::slice_identity_header const& id, Parser& parser) {
+    new_pic_flag = !last_slice || are_different_pictures(*last_slice, id);
+    last_slice = id;
+
+    if(new_pic_flag) dropping = is_dropped(id);
+    if(dropping) return;
+
+    auto new_slice = parse_slice_header(params, parser, id);
 
     if(new_pic_flag) {
-      if(this->current_picture()) dec_ref_pic_marking(*this->current_picture(), this->begin(), this->end());
+      // in trick play the second field may refer to the first one, other pictures start without references
+      if(intra_only && !completes_field_pair(new_slice))
+        this->mark_all_as_unused_for_reference();
+      else
+        mark_current_picture();
+      marking_pending = false;
       
-      if(new_slice.IdrPicFlag || (recovery_point && !poc))
+      if(new_slice.IdrPicFlag || !poc)
         poc = h264::poc_decoder(*params.sps(new_slice));
 
-      if(poc) {
-        this->new_picture(new_slice.IdrPicFlag, new_slice.pic_type, new_slice.frame_num, has_mmco5(new_slice), (*poc)(new_slice));
-        dec_ref_pic_marking = h264::dec_ref_pic_marker(*params.sps(new_slice), std::move(new_slice));
-      }
+      this->new_picture(new_slice.IdrPicFlag, new_slice.pic_type, new_slice.frame_num, has_mmco5(new_slice), (*poc)(new_slice));
+      dec_ref_pic_marking = h264::dec_ref_pic_marker(*params.sps(new_slice), std::move(new_slice));
+      marking_pending = true;
     }
 
-    if(this->current_picture()) current_slice = std::move(new_slice);
+    current_slice = std::move(new_slice);
+  }
+
+  // decides from the first slice of a picture whether the picture is decoded: decoding starts
+  // at an idr picture or a recovery point, trick play takes only intra pictures
+  void mark_current_picture() {
+    if(!marking_pending) return;
+    marking_pending = false;
+    dec_ref_pic_marking(*this->current_picture(), this->begin(), this->end());
+  }
+
+  bool is_dropped(h264::slice_identity_header const& s) const {
+    if(intra_only)
+      return !completes_field_pair(s) && s.slice_type != coding_type::I && s.slice_type != coding_type::SI;
+    return !poc && !s.IdrPicFlag && !recovery_point;
+  }
+
+  bool completes_field_pair(h264::slice_identity_header const& s) const {
+    auto p = this->current_picture();
+    return p && p->frame->structure != structure_type::pair && pic_type(*p) != picture_type::frame
+      && s.pic_type == opposite(pic_type(*p)) && s.frame_num == FrameNum(*p);
   }
 
   h264::parsing_context                     params;
   bool                                      new_pic_flag;
+  utils::optional<h264::slice_identity_header> last_slice;
   utils::optional<h264::slice_header>       current_slice;
   utils::optional<h264::poc_decoder>        poc;
   h264::dec_ref_pic_marker                  dec_ref_pic_marking;
+  bool marking_pending = false;
   bool recovery_point = false;
+  bool intra_only = false;
+  bool dropping = false;
 };
 
 }
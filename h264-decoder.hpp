@@ -7,6 +7,7 @@
 #include "h264-context.hpp"
 
 #include <typeinfo>
+#include <algorithm>
 #include <type_traits>
 
 namespace media {
@@ -21,38 +22,105 @@ using coded_slice = utils::tagged_byte_sequence<coded_slice_tag, BS>;
 
 namespace msvd {
 
-namespace detail {
-template<typename S>
-auto async_decode_slice(decoder& d, std::unique_ptr<detail::h264_context<S>> cx) {
-  utils::promise<decode_result> p;
-  auto f = p.get_future();
+// Completion record of the slices of one access unit. Every slice callback counts pending down
+// and the last one after close() fulfils done, with the first error if a slice failed. The
+// record is then idle and reused for a later access unit, so slices need no synchronisation
+// objects of their own.
+struct slice_completion {
+  std::size_t pending = 0;
+  bool open = false;
+  std::exception_ptr error;
+  utils::promise<void> done;
+  utils::shared_future<void> result;
+
+  bool idle() const { return !open && pending == 0; }
   
-  async_decode_slice(d, std::move(cx), [p = utils::move_on_copy(std::move(p))](std::error_code const& ec, decode_result const& r) mutable {
-    unwrap(p).set_value(r);
-  });
+  friend void reset(slice_completion& c) {
+    c.open = true;
+    c.error = nullptr;
+    c.done = utils::promise<void>();
+    c.result = c.done.get_future().share();
+  }
 
-  return f;
-}
-}
+  friend void complete(slice_completion& c, std::exception_ptr e = nullptr) {
+    if(e && !c.error) c.error = e;
+    if(--c.pending == 0 && !c.open) finish(c);
+  }
 
-template<typename FB, typename BS>
-utils::future<decode_result> async_decode_slice(decoder& d, h264::context<utils::shared_future<FB>> const& cx, h264::coded_slice<BS> slice, std::size_t offset) {
-  std::vector<utils::shared_future<FB>> frames;
-  for(auto& f: cx)
-    frames.push_back(frame_buffer(f));
+  friend void close(slice_completion& c, std::exception_ptr e = nullptr) {
+    if(e && !c.error) c.error = e;
+    c.open = false;
+    if(c.pending == 0) finish(c);
+  }
+
+private:
+  static void finish(slice_completion& c) {
+    if(c.error)
+      c.done.set_exception(c.error);
+    else
+      c.done.set_value();
+  }
+};
 
+// parameters are made by make_h264_parameters for the sps and pps of the slice. The slice is sent
+// at once if the frame buffers it refers to are ready, otherwise when they become ready.
+// callback(std::exception_ptr) is called once the slice is decoded or has failed, also when
+// a frame buffer future holds an exception.
+template<typename Device, typename FB, typename BS, typename F>
+void async_decode_slice(slice_queue<Device>& d, h264::context<utils::shared_future<FB>> const& cx, msvd_h264_decode_params const& parameters, h264::coded_slice<BS> slice, std::size_t offset, F callback) {
   auto s = as_asio_sequence(slice);
-  auto p = std::make_unique<detail::h264_context<decltype(s)>>(cx.sps(), cx.pps(), cx.slice(), cx.begin(), cx.end(), *cx.current_picture(), s, offset);
+  auto p = detail::h264_context_pool<decltype(s)>::default_pool().allocate();
+  p->assign(parameters, cx.sps(), cx.pps(), cx.slice(), cx.begin(), cx.end(), *cx.current_picture(), s, offset,
+    cx.reflists(cx.slice().slice_type, MaxFrameNum(cx.sps())));
+
+  // free slots and frames not used for reference point at the current picture as in h264_context
+  auto curr = frame_buffer(*cx.current_picture());
+  auto buffer = [&](auto& f) { return is_reference(top(f)) || is_reference(bot(f)) ? frame_buffer(f) : curr; };
+
+  // the slice data is released with the callback after the slice is decoded
+  auto done = [s = std::move(slice), callback](std::error_code const& ec, decode_result) mutable {
+    callback(ec ? std::make_exception_ptr(std::system_error(ec)) : std::exception_ptr());
+  };
+
+  auto ready = curr.ready();
+  for(auto& f: cx)
+    ready = ready && buffer(f).ready();
+
+  if(ready) {
+    try {
+      auto i = 0u;
+      for(auto& f: cx)
+        p->dpb_data[i++].phys_addr = phys_addr(buffer(f).get());
+
+      p->curr_pic.phys_addr = phys_addr(curr.get());
+    }
+    catch(...) {
+      return callback(std::current_exception());
+    }
 
-  return when_all(frames.begin(), frames.end()).then([&d, p = std::move(p)](auto ff) mutable {
-    auto frames = ff.get();
-    for(auto i = 0u; i != frames.size(); ++i)
-      p->dpb_data[i].phys_addr = phys_addr(frames[i].get());
+    detail::async_decode_slice(d, std::move(p), std::move(done));
+    return;
+  }
+
+  std::vector<utils::shared_future<FB>> frames;
+  for(auto& f: cx)
+    frames.push_back(buffer(f));
+  frames.push_back(curr);
+
+  when_all(frames.begin(), frames.end()).then([&d, p = std::move(p), done = std::move(done), callback](auto ff) mutable {
+    try {
+      auto frames = ff.get();
+      for(auto i = 0u; i != frames.size() - 1; ++i)
+        p->dpb_data[i].phys_addr = phys_addr(frames[i].get());
     
-    p->curr_pic.phys_addr = phys_addr(frames.back().get());
+      p->curr_pic.phys_addr = phys_addr(frames.back().get());
+    }
+    catch(...) {
+      return callback(std::current_exception());
+    }
 
-    return async_decode_slice(d, std::move(p));
-  }).then([s = std::move(slice)](auto f) { return f; });
+    detail::async_decode_slice(d, std::move(p), std::move(done));
+  });
 }
 
 }
@@ -66,63 +134,199 @@ video::resolution get_resolution(seq_parameter_set const& sps) {
 video::aspect_ratio get_aspect_ratio(seq_parameter_set const& sps) {
   auto aspect_ratio = 1.0;
   if(sps.vui_parameters && sps.vui_parameters->aspect_ratio_information)
-    aspect_ratio = double(sps.vui_parameters->aspect_ratio_information->sar_width) / sps.vui_parameters->aspect_ratio_information->sar_width;
+    aspect_ratio = double(sps.vui_parameters->aspect_ratio_information->sar_width) / sps.vui_parameters->aspect_ratio_information->sar_height;
   return {aspect_ratio};
 }
 
 template<typename Source, typename Sink>
 struct decoder {
   std::unique_ptr<msvd::decoder> hw;
+  // slices of all pushed access units go to the device through one queue, one at a time until
+  // the driver is confirmed to take several slices in flight
+  std::unique_ptr<msvd::slice_queue<msvd::decoder>> queue;
   Source frame_source;
   Sink sink;
 
-  decoder(asio::io_service& io, Source src, Sink sink) : hw(new msvd::decoder{io}), frame_source(std::move(src)), sink(std::move(sink)) {}
+  decoder(asio::io_service& io, Source src, Sink sink) :
+    hw(new msvd::decoder{io}), queue(new msvd::slice_queue<msvd::decoder>(*hw)), frame_source(std::move(src)), sink(std::move(sink)) {}
 
   using frame_type = std::decay_t<decltype(pull(frame_source))>;
 
   context<frame_type> cx;
 
   utils::optional<std::pair<video::resolution, video::aspect_ratio>> dimensions;
+  // parameter sets the dimensions and the reorder window were taken from
+  std::pair<std::uint32_t, seq_parameter_set const*> dimensions_source{0, nullptr};
+
+  // slice request fields derived from the active sps/pps pair
+  msvd_h264_decode_params parameters;
+  std::pair<std::uint32_t, pic_parameter_set const*> parameters_source{0, nullptr};
+
+  // decoded frames waiting for output, a heap with the lowest poc on top
+  struct pending_frame {
+    int poc;
+    std::size_t slot;
+    timestamp ts;
+    utils::shared_future<void> decoded;
+    frame_type frame;
+
+    friend bool operator < (pending_frame const& a, pending_frame const& b) { return a.poc > b.poc; }
+  };
+  std::vector<pending_frame> reorder;
+
+  // completion records of access units in flight and of the one being pushed
+  std::vector<std::unique_ptr<msvd::slice_completion>> completions;
+  msvd::slice_completion* completion = nullptr;
+  std::size_t reorder_window = 0;
+  std::size_t dpb_size = 16;
+  bool idr_or_mmco5 = false;
+  bool mmco5 = false;
+
+  // decode only intra pictures, e.g. for fast forward and rewind
+  friend void set_trick_play(decoder& d, bool on) {
+    d.bump(0, 0);
+    d.cx.set_intra_only(on);
+  }
+
+  // outputs the frames still waiting for reordering, at the end of the stream or before a seek
+  friend void flush(decoder& d) {
+    d.bump(0, 0);
+  }
 
   template<typename BS>
   friend utils::shared_future<void> push(decoder& d, timestamp const& ts, annexb::access_unit<BS> au) noexcept {
     try {
-      std::vector<utils::future<msvd::decode_result>> slices;
-
-      for(auto r = next_nal_unit(std::move(au)); !empty(r.first); r = next_nal_unit(std::move(r.second))) {
-        auto pos = d.cx(r.first);
-        if(d.cx.is_new_slice()) {
-          auto m = std::make_pair(get_resolution(d.cx.sps()), get_aspect_ratio(d.cx.sps()));
-          if(!d.dimensions || m != *d.dimensions) set_dimensions(d.sink, m.first, m.second);
-          d.dimensions = m;
-          
-          if(d.cx.is_new_picture() && pic_type(*d.cx.current_picture()) != picture_type::bot)
-            frame_buffer(*d.cx.current_picture()->frame, pull(d.frame_source));
-      
-          slices.push_back(async_decode_slice(*d.hw, d.cx, utils::tag<coded_slice_tag>(std::move(r.first)), pos));
-        }
-      }
+      for(auto r = next_nal_unit(std::move(au)); !empty(r.first); r = next_nal_unit(std::move(r.second)))
+        d.decode_nal_unit(std::move(r.first));
 
-      auto f = when_all(slices.begin(), slices.end());
-      utils::shared_future<void> r;
-    
-      if(d.cx.current_picture() && pic_type(*d.cx.current_picture()) != picture_type::top) {
-//        r = f.then([frame = frame_buffer(*d.cx.current_picture()), ts, sink = d.sink](auto) mutable { push(sink, ts, frame); });
-        r = f.then([](auto f) {}).share();
-        push(d.sink, ts, r.then([frame = frame_buffer(*d.cx.current_picture())](auto) { return frame.get(); }).share());
-        mark_as_not_needed_for_output(*d.cx.current_picture()->frame);
-      
-        d.cx.erase(h264::remove_unused_pictures(d.cx.begin(), d.cx.current_picture()->frame), d.cx.current_picture()->frame);      
-      } 
-      else
-        r = f.then([](auto f) {}).share();
-        
-      return r; 
+      return d.finish_access_unit(ts);
     }
     catch(...) {
+      d.abandon_access_unit(std::current_exception());
       return utils::make_exceptional_future<void>(std::current_exception());
     }
   }
+
+  // nal units without start codes, e.g. depacketized from rtp
+  template<typename BS>
+  friend utils::shared_future<void> push(decoder& d, timestamp const& ts, std::vector<nal_unit<BS>> nal_units) noexcept {
+    try {
+      for(auto& n: nal_units)
+        d.decode_nal_unit(std::move(n));
+
+      return d.finish_access_unit(ts);
+    }
+    catch(...) {
+      d.abandon_access_unit(std::current_exception());
+      return utils::make_exceptional_future<void>(std::current_exception());
+    }
+  }
+
+private:
+  template<typename NalUnit>
+  void decode_nal_unit(NalUnit nalu) {
+    auto pos = cx(nalu);
+    if(cx.is_new_slice()) {
+      auto source = std::make_pair(cx.parameters_version(), &cx.sps());
+      if(source != dimensions_source) {
+        auto m = std::make_pair(get_resolution(cx.sps()), get_aspect_ratio(cx.sps()));
+        if(!dimensions || m != *dimensions) set_dimensions(sink, m.first, m.second);
+        dimensions = m;
+        dimensions_source = source;
+        reorder_window = max_num_reorder_frames(cx.sps());
+        dpb_size = std::max(max_dec_frame_buffering(cx.sps()), 1u);
+      }
+      
+      if(cx.is_new_picture() && pic_type(*cx.current_picture()) != picture_type::bot) {
+        frame_buffer(*cx.current_picture()->frame, pull(frame_source));
+        idr_or_mmco5 = cx.slice().IdrPicFlag || has_mmco5(cx.slice());
+        mmco5 = has_mmco5(cx.slice());
+      }
+  
+      auto pps = std::make_pair(cx.parameters_version(), &cx.pps());
+      if(pps != parameters_source) {
+        parameters = msvd::detail::make_h264_parameters<std::decay_t<decltype(frame_buffer(*cx.current_picture()))>>(cx.sps(), cx.pps());
+        parameters_source = pps;
+      }
+
+      if(!completion) completion = &acquire_completion();
+      ++completion->pending;
+
+      // a slice that fails before it is submitted fails the access unit like a decoding error
+      try {
+        async_decode_slice(*queue, cx, parameters, utils::tag<coded_slice_tag>(std::move(nalu)), pos,
+          [c = completion](std::exception_ptr e) { complete(*c, e); });
+      }
+      catch(...) {
+        complete(*completion, std::current_exception());
+      }
+    }
+  }
+
+  // slices already submitted still count down the record, which no longer takes new ones
+  void abandon_access_unit(std::exception_ptr e) {
+    if(!completion) return;
+    close(*completion, e);
+    completion = nullptr;
+  }
+
+  msvd::slice_completion& acquire_completion() {
+    auto i = std::find_if(completions.begin(), completions.end(), [](auto& c) { return c->idle(); });
+    if(i == completions.end())
+      i = completions.insert(completions.end(), std::make_unique<msvd::slice_completion>());
+
+    reset(**i);
+    return **i;
+  }
+
+  utils::shared_future<void> finish_access_unit(timestamp const& ts) {
+    // nothing was decoded, e.g. a picture dropped in trick play, current_picture() is still the previous one
+    if(!completion) return utils::make_ready_future().share();
+
+    auto r = completion->result;
+    close(*completion);
+    completion = nullptr;
+  
+    if(cx.current_picture() && pic_type(*cx.current_picture()) != picture_type::top) {
+      // 8.2.1: after mmco5 the poc of the picture is relative to itself
+      if(mmco5) {
+        auto& curr = *cx.current_picture()->frame;
+        auto temp = PicOrderCnt(curr);
+        TopFieldOrderCnt(curr, TopFieldOrderCnt(curr) - temp);
+        BotFieldOrderCnt(curr, BotFieldOrderCnt(curr) - temp);
+      }
+
+      // C.4.4: earlier pictures are output before an idr picture or a picture with mmco5
+      if(idr_or_mmco5) bump(0, 0);
+
+      cx.store_current_picture();
+
+      auto& curr = *cx.current_picture()->frame;
+      reorder.push_back(pending_frame{PicOrderCnt(curr), std::size_t(&curr - cx.begin()), ts, r, frame_buffer(curr)});
+      std::push_heap(reorder.begin(), reorder.end());
+
+      cx.remove_unused_pictures();
+      bump(reorder_window, dpb_size);
+    } 
+      
+    return r; 
+  }
+
+  // C.4.5.3 bumping: outputs the frame with the lowest poc while more than window frames wait
+  // for output or the dpb is over size frames including the current one, frames no longer
+  // used are removed. The current picture is marked by then, so the next one finds a free slot.
+  void bump(std::size_t window, std::size_t size) {
+    while(!reorder.empty() && (reorder.size() > window || cx.size() > size)) {
+      std::pop_heap(reorder.begin(), reorder.end());
+      auto& p = reorder.back();
+
+      push(sink, p.ts, p.decoded.then([frame = p.frame](auto) { return frame.get(); }).share());
+
+      mark_as_not_needed_for_output(cx[p.slot]);
+      reorder.pop_back();
+      cx.remove_unused_pictures();
+    }
+  }
 };
 
 template<typename Source, typename Sink>
@@ -9,47 +9,68 @@
 namespace media {
 namespace h264 {
 
-enum class ref_type { none, short_term, long_term };
-
 enum class structure_type { frame, top, bot, pair };
 inline bool has_top(structure_type s) { return s != structure_type::bot; }
 inline bool has_bot(structure_type s) { return s != structure_type::top; }
 
+// reference and output state of the frames of a dpb as bit masks indexed by slot, the reference
+// masks have two bits per slot, for the top and the bottom field
+struct dpb_state {
+  std::uint64_t short_term = 0;
+  std::uint64_t long_term = 0;
+  std::uint32_t needed_for_output = 0;
+  std::uint32_t used = 0;
+};
+
 template<typename Buffer>
-struct frame {
-  frame(unsigned frame_num, structure_type structure) : frame_num(frame_num), structure(structure) {}
+class decoded_picture_buffer;
 
-  unsigned frame_num;
+template<typename Buffer>
+struct frame {
+  unsigned frame_num = 0;
   unsigned long_term_frame_idx = -1u;
 
-  structure_type structure;
+  structure_type structure = structure_type::frame;
 
   template<typename T>
   struct field_base {
     int poc = 0; 
-    ref_type rt = ref_type::none;
+
+    std::uint64_t bit() const { return std::uint64_t(1) << (2 * get_frame(static_cast<T const&>(*this)).slot + T::parity); }
+    dpb_state& state() const { return *get_frame(static_cast<T const&>(*this)).state; }
   
-    friend bool is_short_term_reference(field_base const& f) { return f.rt == ref_type::short_term; }
-    friend bool is_long_term_reference(field_base const& f) { return f.rt == ref_type::long_term; }
-    friend bool is_reference(field_base const& f) { return f.rt != ref_type::none; }
+    friend bool is_short_term_reference(field_base const& f) { return f.state().short_term & f.bit(); }
+    friend bool is_long_term_reference(field_base const& f) { return f.state().long_term & f.bit(); }
+    friend bool is_reference(field_base const& f) { return (f.state().short_term | f.state().long_term) & f.bit(); }
 
-    friend void mark_as_short_term_reference(field_base& f) { f.rt = ref_type::short_term; }
+    friend void mark_as_short_term_reference(field_base& f) {
+      f.state().short_term |= f.bit();
+      f.state().long_term &= ~f.bit();
+    }
     friend void mark_as_long_term_reference(field_base& f, unsigned long_term_frame_idx) {
-      f.rt = ref_type::long_term;
+      f.state().long_term |= f.bit();
+      f.state().short_term &= ~f.bit();
       get_frame(static_cast<T&>(f)).long_term_frame_idx = long_term_frame_idx;
     }
-    friend void mark_as_unused_for_reference(field_base& f) { f.rt = ref_type::none; }
-    friend Buffer frame_buffer(field_base const& f) { return get_frame(f).buffer; }
+    friend void mark_as_unused_for_reference(field_base& f) {
+      f.state().short_term &= ~f.bit();
+      f.state().long_term &= ~f.bit();
+    }
+    friend Buffer frame_buffer(field_base const& f) { return get_frame(static_cast<T const&>(f)).buffer; }
   };
 
-  struct top_field : field_base<top_field> {} top;
-  struct bot_field : field_base<bot_field> {} bot;
+  struct top_field : field_base<top_field> { static constexpr unsigned parity = 0; } top;
+  struct bot_field : field_base<bot_field> { static constexpr unsigned parity = 1; } bot;
 
 private:
+  friend class decoded_picture_buffer<Buffer>;
+
   Buffer buffer;
-public:
-  bool needed_for_output = true;
+  dpb_state* state = nullptr;
+  unsigned slot = 0;
 
+  std::uint64_t bits() const { return std::uint64_t(3) << (2 * slot); }
+public:
   friend frame const& get_frame(top_field const& top) { return *utils::container_of(&top, &frame::top); }
   friend frame const& get_frame(bot_field const& bot) { return *utils::container_of(&bot, &frame::bot); };
   friend frame& get_frame(top_field& top) { return *utils::container_of(&top, &frame::top); }
@@ -68,13 +89,20 @@ public:
   friend void FrameNum(frame& f, unsigned frame_num) { f.frame_num = frame_num; }
   friend unsigned LongTermFrameIdx(frame const& f) { return f.long_term_frame_idx; }
 
-  friend bool is_short_term_reference(frame const& f) { return f.top.rt == ref_type::short_term && f.bot.rt == ref_type::short_term; }
-  friend bool is_long_term_reference(frame const& f) { return f.top.rt == ref_type::long_term && f.bot.rt == ref_type::long_term; }
+  friend bool is_short_term_reference(frame const& f) { return (f.state->short_term & f.bits()) == f.bits(); }
+  friend bool is_long_term_reference(frame const& f) { return (f.state->long_term & f.bits()) == f.bits(); }
 
-  friend void mark_as_unused_for_reference(frame& f) { f.top.rt = f.bot.rt = ref_type::none; }
-  friend void mark_as_short_term_reference(frame& f) { f.top.rt = f.bot.rt = ref_type::short_term; }
+  friend void mark_as_unused_for_reference(frame& f) {
+    f.state->short_term &= ~f.bits();
+    f.state->long_term &= ~f.bits();
+  }
+  friend void mark_as_short_term_reference(frame& f) {
+    f.state->short_term |= f.bits();
+    f.state->long_term &= ~f.bits();
+  }
   friend void mark_as_long_term_reference(frame& f, unsigned long_term_frame_idx) {
-    f.top.rt = f.bot.rt = ref_type::long_term;
+    f.state->long_term |= f.bits();
+    f.state->short_term &= ~f.bits();
     f.long_term_frame_idx = long_term_frame_idx;
   }
 
@@ -96,45 +124,171 @@ public:
   // returns true if frame consists of fields (i.e a single field or complementary pair)
   friend bool field_flag(frame const& f) { return f.structure != structure_type::frame; }
 
-  friend bool is_needed_for_output(frame const& f) { return f.needed_for_output; }
-  friend void mark_as_not_needed_for_output(frame& f) { f.needed_for_output = false; }
+  friend bool is_needed_for_output(frame const& f) { return f.state->needed_for_output & (1u << f.slot); }
+  friend void mark_as_not_needed_for_output(frame& f) { f.state->needed_for_output &= ~(1u << f.slot); }
 };
 
+// Frames stay in their slot from decoding until removal, so iterators, picture references and
+// slot indices (the indices of the msvd dpb array) remain valid. Iteration covers the slots up
+// to the last one in use, free slots are neither references nor needed for output.
 template<typename Buffer>
-class decoded_picture_buffer : public std::vector<frame<Buffer>> {
-  //utils::optional<picture_reference<typename std::vector<frame<Buffer>>::iterator>> curr_pic;
-  picture_type curr_pic_type = picture_type::top;
+class decoded_picture_buffer {
+public:
+  static constexpr std::size_t capacity = 17;
+
+  using value_type = frame<Buffer>;
+  using iterator = value_type*;
+  using const_iterator = value_type const*;
+
+  decoded_picture_buffer() { bind(); }
+  decoded_picture_buffer(decoded_picture_buffer const& b) : state(b.state), frames(b.frames), curr(b.curr), curr_pic_type(b.curr_pic_type), curr_stored(b.curr_stored) { bind(); }
+
+  decoded_picture_buffer& operator=(decoded_picture_buffer const& b) {
+    state = b.state;
+    frames = b.frames;
+    curr = b.curr;
+    curr_pic_type = b.curr_pic_type;
+    curr_stored = b.curr_stored;
+    ++generation;
+    bind();
+    return *this;
+  }
 
-  bool is_new_frame(bool IdrPicFlag, picture_type pt, unsigned frame_num, bool has_mmco5) {
-    return !current_picture() || IdrPicFlag || !(opposite(pt) == pic_type(*current_picture())) || !(frame_num == FrameNum(*current_picture())) || has_mmco5;
+  iterator begin() { return frames.data(); }
+  iterator end() { return frames.data() + slots_in_use(); }
+  const_iterator begin() const { return frames.data(); }
+  const_iterator end() const { return frames.data() + slots_in_use(); }
+
+  std::size_t size() const { return __builtin_popcount(state.used); }
+  bool empty() const { return !state.used; }
+
+  value_type& operator[](std::size_t slot) { return frames[slot]; }
+  value_type const& operator[](std::size_t slot) const { return frames[slot]; }
+
+  void clear() {
+    release(state.used);
+    state = dpb_state{};
+    curr = -1u;
+    curr_stored = false;
+    ++generation;
   }
-public:
-  using std::vector<frame<Buffer>>::vector;
 
-  utils::optional<picture_reference<typename std::vector<frame<Buffer>>::const_iterator>> current_picture() const {
-    if(this->empty()) return utils::nullopt; 
-    return picture_reference<typename std::vector<frame<Buffer>>::const_iterator>{this->end()-1, curr_pic_type};
+  void mark_all_as_unused_for_reference() { state.short_term = state.long_term = 0; }
+
+  // initial reference lists of the current picture for P and B slices, computed for the first
+  // slice of the type and reused until the picture or the reference marking changes
+  initial_reflists<const_iterator> const* reflists(coding_type t, unsigned max_frame_num) const {
+    if(t != coding_type::P && t != coding_type::B) return nullptr;
+
+    auto& c = cache[t == coding_type::B];
+    if(!c.valid || c.generation != generation || c.short_term != state.short_term || c.long_term != state.long_term) {
+      auto frames = utils::make_range(begin(), end());
+      c.lists = t == coding_type::B ?
+        initialise_reflists_for_b_slice(*current_picture(), frames) :
+        initialise_reflists_for_p_slice(max_frame_num, *current_picture(), frames);
+      c.valid = true;
+      c.generation = generation;
+      c.short_term = state.short_term;
+      c.long_term = state.long_term;
+    }
+    return &c.lists;
+  }
+
+  // C.4.4: frees the slots of frames neither used for reference nor needed for output, the
+  // current picture is kept until it is stored or the next picture starts
+  void remove_unused_pictures() {
+    std::uint32_t ref = 0;
+    for(auto r = state.short_term | state.long_term; r; r &= r - 1)
+      ref |= 1u << (__builtin_ctzll(r) / 2);
+
+    auto used = state.used & (ref | state.needed_for_output | (curr != -1u && !curr_stored ? 1u << curr : 0));
+    release(state.used & ~used);
+    state.used = used;
   }
 
-  utils::optional<picture_reference<typename std::vector<frame<Buffer>>::iterator>> current_picture() {
-    if(this->empty()) return utils::nullopt; 
-    return picture_reference<typename std::vector<frame<Buffer>>::iterator>{this->end()-1, curr_pic_type};
+  // the current picture is marked, from now on it is kept only while used for reference or
+  // needed for output as the other frames (C.4.5.2)
+  void store_current_picture() { curr_stored = true; }
+
+  utils::optional<picture_reference<const_iterator>> current_picture() const {
+    if(curr == -1u) return utils::nullopt; 
+    return picture_reference<const_iterator>{frames.data() + curr, curr_pic_type};
+  }
+
+  utils::optional<picture_reference<iterator>> current_picture() {
+    if(curr == -1u) return utils::nullopt; 
+    return picture_reference<iterator>{frames.data() + curr, curr_pic_type};
   }
 
   void new_picture(bool IdrPicFlag, picture_type pt, unsigned frame_num, bool has_mmco5, poc_t poc) {
     if(is_new_frame(IdrPicFlag, pt, frame_num, has_mmco5)) {
-      this->push_back(frame<Buffer>{frame_num, static_cast<structure_type>(pt)});
+      // the previous picture is marked by now, the frames it no longer refers to make room
+      curr = -1u;
+      remove_unused_pictures();
+
+      if(state.used == (1u << capacity) - 1) throw std::runtime_error("decoded picture buffer overflow");
+
+      curr = __builtin_ctz(~state.used);
+      auto& f = frames[curr];
+      f.frame_num = frame_num;
+      f.long_term_frame_idx = -1u;
+      f.structure = static_cast<structure_type>(pt);
+      f.top.poc = f.bot.poc = 0;
+      f.buffer = Buffer();
+
+      state.used |= 1u << curr;
+      state.needed_for_output |= 1u << curr;
+      mark_as_unused_for_reference(f);
     }
     else
-      this->back().structure = structure_type::pair;
+      frames[curr].structure = structure_type::pair;
 
     curr_pic_type = pt;
+    curr_stored = false;
+    ++generation;
 
     assert(!is_short_term_reference(*current_picture()) && !is_long_term_reference(*current_picture()));
 
     if(has_top(pt)) TopFieldOrderCnt(*current_picture(), poc.top);
     if(has_bot(pt)) BotFieldOrderCnt(*current_picture(), poc.bot);
   }
+
+private:
+  dpb_state state;
+  std::array<value_type, capacity> frames;
+  unsigned curr = -1u;
+  picture_type curr_pic_type = picture_type::top;
+  bool curr_stored = false;
+
+  struct cached_reflists {
+    initial_reflists<const_iterator> lists;
+    bool valid = false;
+    unsigned generation;
+    std::uint64_t short_term;
+    std::uint64_t long_term;
+  };
+  // not copied, the lists point into the frames of this dpb
+  mutable std::array<cached_reflists, 2> cache;
+  unsigned generation = 0;
+
+  void bind() {
+    for(unsigned i = 0; i != capacity; ++i) {
+      frames[i].state = &state;
+      frames[i].slot = i;
+    }
+  }
+
+  // drops the frame buffers of freed slots, so they are not held until the slot is reused
+  void release(std::uint32_t slots) {
+    for(; slots; slots &= slots - 1)
+      frames[__builtin_ctz(slots)].buffer = Buffer();
+  }
+
+  std::size_t slots_in_use() const { return state.used ? 32 - __builtin_clz(state.used) : 0; }
+
+  bool is_new_frame(bool IdrPicFlag, picture_type pt, unsigned frame_num, bool has_mmco5) {
+    return !current_picture() || IdrPicFlag || !(opposite(pt) == pic_type(*current_picture())) || !(frame_num == FrameNum(*current_picture())) || has_mmco5;
+  }
 };
 
 }
@@ -395,17 +395,53 @@ O initialise_reflist(picture_type curr_pic_type, K key, I first_frame, I last_fr
   return last_long_term;
 }
 
+// initial reference lists, the same for all slices of a picture, so they can be computed once
+// per picture and reused with the modifications of each slice
+template<typename I>
+struct initial_reflists {
+  std::array<picture_reference<I>, 32> lists[2] = {{{}}, {{}}};
+  std::size_t sizes[2] = {0, 0};
+};
+
+// 8.2.4.2.1, 8.2.4.2.2 Initialisation process for the reference picture list for P and SP slices
+template<typename C, typename I>
+initial_reflists<I> initialise_reflists_for_p_slice(unsigned max_frame_num, C const& curr_pic, utils::range<I> frames) {
+  initial_reflists<I> r;
+  auto& l = r.lists[0];
+  r.sizes[0] = initialise_reflist(pic_type(curr_pic), [&](picture_reference<I> const& p) { return -FrameNumWrap(max_frame_num, curr_pic, p); },
+                                  begin(frames), end(frames), begin(l), end(l)) - begin(l);
+  return r;
+}
+
+// 8.2.4.2.3, 8.2.4.2.4 Initialisation process for reference picture lists for B slices
+template<typename C, typename I>
+initial_reflists<I> initialise_reflists_for_b_slice(C const& curr_pic, utils::range<I> frames) {
+  initial_reflists<I> r;
+
+  auto key0 = [&](picture_reference<I> const& a) {
+    return ((PicOrderCnt(a) <= PicOrderCnt(curr_pic)) ? std::make_tuple(false, -PicOrderCnt(a)-1) : std::make_tuple(true, PicOrderCnt(a)+1)); 
+  };
+  r.sizes[0] = initialise_reflist(pic_type(curr_pic), key0, begin(frames), end(frames), begin(r.lists[0]), end(r.lists[0])) - begin(r.lists[0]);
+
+  auto key1 = [&](picture_reference<I> const& a) {
+    return ((PicOrderCnt(a) > PicOrderCnt(curr_pic)) ? std::make_tuple(false, PicOrderCnt(a)+1) : std::make_tuple(true, -PicOrderCnt(a)-1));
+  };
+  r.sizes[1] = initialise_reflist(pic_type(curr_pic), key1, begin(frames), end(frames), begin(r.lists[1]), end(r.lists[1])) - begin(r.lists[1]);
+
+  return r;
+}
+
 template<typename C, typename I, typename M, typename O>
 O generate_reflist_for_p_slice(unsigned max_frame_num, C const& curr_pic,
   utils::range<I> frames,
+  initial_reflists<I> const& initial,
   utils::range<M> modifications,
   O output, std::size_t num_ref_idx_l0_active) 
 {
-  std::array<picture_reference<I>,32> ref = {{}};
+  auto ref = initial.lists[0];
   num_ref_idx_l0_active = std::min(num_ref_idx_l0_active, ref.size());
 
-  auto i = initialise_reflist(pic_type(curr_pic), [&](picture_reference<I> const& p) { return -FrameNumWrap(max_frame_num, curr_pic, p); },
-                              begin(frames), end(frames), begin(ref), end(ref));
+  auto i = begin(ref) + initial.sizes[0];
   if(i != ref.begin()) std::fill(i, ref.end(), *(i-1));
 
   auto r = ref_pic_list_modification(max_frame_num, curr_pic, begin(frames), end(frames), begin(modifications), end(modifications), begin(ref), end(ref));
@@ -413,27 +449,32 @@ O generate_reflist_for_p_slice(unsigned max_frame_num, C const& curr_pic,
   return std::copy(begin(ref), std::min(begin(ref) + num_ref_idx_l0_active, std::max(i,r)), output);
 }
 
+template<typename C, typename I, typename M, typename O>
+O generate_reflist_for_p_slice(unsigned max_frame_num, C const& curr_pic,
+  utils::range<I> frames,
+  utils::range<M> modifications,
+  O output, std::size_t num_ref_idx_l0_active) 
+{
+  return generate_reflist_for_p_slice(max_frame_num, curr_pic, frames, initialise_reflists_for_p_slice(max_frame_num, curr_pic, frames),
+    modifications, output, num_ref_idx_l0_active);
+}
+
 template<typename C, typename I, typename M, typename O>
 std::pair<O,O> generate_reflists_for_b_slice(unsigned max_frame_num, C const& curr_pic,
   utils::range<I> frames,
+  initial_reflists<I> const& initial,
   utils::range<M> modifications0, utils::range<M> modifications1,
   O output0, std::size_t num_ref_idx_l0_active,
   O output1, std::size_t num_ref_idx_l1_active) 
 {
-  std::array<picture_reference<I>,32> ref0={{}}, ref1={{}};
+  auto ref0 = initial.lists[0];
+  auto ref1 = initial.lists[1];
 
   num_ref_idx_l0_active = std::min(num_ref_idx_l0_active, ref0.size());
   num_ref_idx_l1_active = std::min(num_ref_idx_l1_active, ref1.size());
 
-  auto key0 = [&](picture_reference<I> const& a) {
-    return ((PicOrderCnt(a) <= PicOrderCnt(curr_pic)) ? std::make_tuple(false, -PicOrderCnt(a)-1) : std::make_tuple(true, PicOrderCnt(a)+1)); 
-  };
-  auto i0 = initialise_reflist(pic_type(curr_pic), key0, begin(frames), end(frames), begin(ref0), end(ref0)); 
-
-  auto key1 = [&](picture_reference<I> const& a) {
-    return ((PicOrderCnt(a) > PicOrderCnt(curr_pic)) ? std::make_tuple(false, PicOrderCnt(a)+1) : std::make_tuple(true, -PicOrderCnt(a)-1));
-  };
-  auto i1 = initialise_reflist(pic_type(curr_pic), key1, begin(frames), end(frames), begin(ref1), end(ref1)); 
+  auto i0 = begin(ref0) + initial.sizes[0];
+  auto i1 = begin(ref1) + initial.sizes[1];
 
   if(num_ref_idx_l1_active > 1 && num_ref_idx_l0_active == num_ref_idx_l1_active && std::equal(begin(ref0), begin(ref0) + num_ref_idx_l0_active, begin(ref1)))
     std::swap(ref1[0], ref1[1]);
@@ -448,6 +489,17 @@ std::pair<O,O> generate_reflists_for_b_slice(unsigned max_frame_num, C const& cu
                         std::copy(begin(ref1), std::min(begin(ref1) + num_ref_idx_l1_active, std::max(i1, r1)), output1));
 }
 
+template<typename C, typename I, typename M, typename O>
+std::pair<O,O> generate_reflists_for_b_slice(unsigned max_frame_num, C const& curr_pic,
+  utils::range<I> frames,
+  utils::range<M> modifications0, utils::range<M> modifications1,
+  O output0, std::size_t num_ref_idx_l0_active,
+  O output1, std::size_t num_ref_idx_l1_active) 
+{
+  return generate_reflists_for_b_slice(max_frame_num, curr_pic, frames, initialise_reflists_for_b_slice(curr_pic, frames),
+    modifications0, modifications1, output0, num_ref_idx_l0_active, output1, num_ref_idx_l1_active);
+}
+
 template<typename I, typename C>
 void mark_as_long_term_reference(I first_frame, I last_frame, C& pic, unsigned long_term_frame_idx) {
  for_each_picture(first_frame, last_frame, [&](picture_reference<I> const& p) {
@@ -493,26 +545,34 @@ void adaptive_memory_control(unsigned max_frame_num, memory_management_control_o
   }
 }
 
-// 8.2.5.3 Sliding window decoded reference picture marking process
+// 8.2.5.3 Sliding window decoded reference picture marking process, frames are not kept in
+// decoding order, the short-term frame with the lowest FrameNumWrap is removed
 template<typename C, typename I>
-void dec_ref_pic_marking_sliding_window(unsigned max_num_ref_frames, C& curr_pic, I begin, I end) {
-  int numShortTerm = 0, numLongTerm = 0;
-  for(auto b = begin, e = end; b != e; ++b) {
-    if((pic_type(curr_pic) == picture_type::top && is_short_term_reference(bot(*b)) && FrameNum(*b) == FrameNum(curr_pic))
-      || (pic_type(curr_pic) == picture_type::bot && is_short_term_reference(top(*b)) && FrameNum(*b) == FrameNum(curr_pic)))
-      continue;
+void dec_ref_pic_marking_sliding_window(unsigned max_frame_num, unsigned max_num_ref_frames, C& curr_pic, I begin, I end) {
+  auto curr = curr_pic.frame;
 
-    if(is_short_term_reference(*b) || is_short_term_reference(top(*b)) || is_short_term_reference(bot(*b))) ++numShortTerm;
-    else if(is_long_term_reference(*b) || is_long_term_reference(top(*b)) || is_long_term_reference(bot(*b))) ++numLongTerm;
+  // the second field of a pair whose first field is a short-term reference is marked as the first one
+  if(pic_type(curr_pic) != picture_type::frame && (is_short_term_reference(top(*curr)) || is_short_term_reference(bot(*curr))))
+    return;
+
+  auto is_short_term = [](decltype(*begin) f) { return is_short_term_reference(top(f)) || is_short_term_reference(bot(f)); };
+  auto is_long_term = [](decltype(*begin) f) { return is_long_term_reference(top(f)) || is_long_term_reference(bot(f)); };
+
+  int numShortTerm = 0, numLongTerm = 0;
+  for(auto b = begin; b != end; ++b) {
+    if(b == curr) continue;
+    if(is_short_term(*b)) ++numShortTerm;
+    else if(is_long_term(*b)) ++numLongTerm;
   }
 
-  int n = std::min(numShortTerm + numLongTerm - std::max(int(max_num_ref_frames), 1), numShortTerm);
-  
-  for(auto b = begin, e = end; b != e && n >= 0; ++b) {
-    if(is_short_term_reference(*b)) {
-      mark_as_unused_for_reference(*b);
-      --n;
-    }
+  for(int n = std::min(numShortTerm + numLongTerm - std::max(int(max_num_ref_frames), 1), numShortTerm); n >= 0; --n) {
+    auto i = end;
+    for(auto b = begin; b != end; ++b)
+      if(b != curr && is_short_term(*b) && (i == end || FrameNumWrap(max_frame_num, curr_pic, *b) < FrameNumWrap(max_frame_num, curr_pic, *i)))
+        i = b;
+
+    if(i == end) break;
+    mark_as_unused_for_reference(*i);
   }
 }
 
@@ -524,7 +584,7 @@ struct dec_ref_pic_marker {
   bool IdrPicFlag;
   bool long_term_reference_flag;
 
-  std::vector<memory_management_control_operation> mmcos;
+  decltype(slice_header::mmcos) mmcos;
 
   dec_ref_pic_marker() {}
   dec_ref_pic_marker(seq_parameter_set const& sps, slice_header&& slice) :
@@ -533,7 +593,7 @@ struct dec_ref_pic_marker {
     nal_ref_idc(slice.nal_ref_idc),
     IdrPicFlag(slice.IdrPicFlag),
     long_term_reference_flag(slice.long_term_reference_flag),
-    mmcos(std::move(slice.mmcos)) 
+    mmcos(slice.mmcos)
   {}
 
   template<typename Picture, typename Iterator>
@@ -550,7 +610,7 @@ struct dec_ref_pic_marker {
     }
     else {
       if(mmcos.empty())
-        dec_ref_pic_marking_sliding_window(max_num_ref_frames, curr_pic, begin, end);
+        dec_ref_pic_marking_sliding_window(max_frame_num, max_num_ref_frames, curr_pic, begin, end);
       else {
         for(auto& op: mmcos)
           try {
@@ -565,12 +625,6 @@ struct dec_ref_pic_marker {
   }
 };
 
-// C.4.4 Removal of pictures from the DPB before possible insertion of the current picture
-template<typename I>
-I remove_unused_pictures(I begin, I end) {
-  return std::remove_if(begin, end, [](decltype(*begin) v) { return !is_needed_for_output(v) && !is_short_term_reference(v) && !is_long_term_reference(v); });
-}
-
 } // namespace h264
 } // namespace media
 
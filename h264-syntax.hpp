@@ -3,6 +3,8 @@
 
 #include <array>
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
 
 #include "utils.hpp"
 #include "bitstream.hpp"
@@ -100,12 +102,68 @@ struct scaling_lists {
   std::array<std::array<std::uint8_t, 64>,6> lists_8x8;
 };
 
+struct hrd_params {
+  struct cpb_spec {
+    unsigned bit_rate_value_minus1;
+    unsigned cpb_size_value_minus1;
+    bool     cbr_flag;
+  };
+
+  unsigned bit_rate_scale;
+  unsigned cpb_size_scale;
+  std::vector<cpb_spec> cpb_specs;
+  unsigned initial_cpb_removal_delay_length_minus1 = 23;
+  unsigned cpb_removal_delay_length_minus1 = 23;
+  unsigned dpb_output_delay_length_minus1 = 23;
+  unsigned time_offset_length = 24;
+};
+
 struct vui_params {
   struct aspect_ratio {
     std::uint16_t sar_width;
     std::uint16_t sar_height;
   };
   utils::optional<aspect_ratio> aspect_ratio_information;
+
+  utils::optional<bool> overscan_appropriate_flag;
+
+  struct video_signal_type {
+    unsigned video_format = 5;
+    bool     video_full_range_flag = false;
+    unsigned colour_primaries = 2;
+    unsigned transfer_characteristics = 2;
+    unsigned matrix_coefficients = 2;
+  };
+  utils::optional<video_signal_type> video_signal;
+
+  struct chroma_loc_info {
+    unsigned chroma_sample_loc_type_top_field;
+    unsigned chroma_sample_loc_type_bottom_field;
+  };
+  utils::optional<chroma_loc_info> chroma_location;
+
+  struct timing_info {
+    std::uint32_t num_units_in_tick;
+    std::uint32_t time_scale;
+    bool          fixed_frame_rate_flag;
+  };
+  utils::optional<timing_info> timing;
+
+  utils::optional<hrd_params> nal_hrd_parameters;
+  utils::optional<hrd_params> vcl_hrd_parameters;
+  bool low_delay_hrd_flag = false;
+  bool pic_struct_present_flag = false;
+
+  struct bitstream_restriction {
+    bool     motion_vectors_over_pic_boundaries_flag;
+    unsigned max_bytes_per_pic_denom;
+    unsigned max_bits_per_mb_denom;
+    unsigned log2_max_mv_length_horizontal;
+    unsigned log2_max_mv_length_vertical;
+    unsigned max_num_reorder_frames;
+    unsigned max_dec_frame_buffering;
+  };
+  utils::optional<bitstream_restriction> restriction;
 };
 
 struct seq_parameter_set {
@@ -163,6 +221,47 @@ inline unsigned ChromaArrayType(seq_parameter_set const& sps) {
 
 inline unsigned MaxFrameNum(seq_parameter_set const& sps) { return 1 << (sps.log2_max_frame_num_minus4 + 4); }
 
+// dpb size in frames allowed by the level, table A-1, 16 for unknown levels
+inline unsigned MaxDpbFrames(seq_parameter_set const& sps) {
+  static const std::pair<unsigned, unsigned> max_dpb_mbs[] = {
+    {9, 396}, {10, 396}, {11, 900}, {12, 2376}, {13, 2376},
+    {20, 2376}, {21, 4752}, {22, 8100},
+    {30, 8100}, {31, 18000}, {32, 20480},
+    {40, 32768}, {41, 32768}, {42, 34816},
+    {50, 110400}, {51, 184320}, {52, 184320},
+    {60, 696320}, {61, 696320}, {62, 696320}
+  };
+
+  // level 1b of the baseline, main and extended profiles
+  auto level_idc = sps.level_idc == 11 && sps.constrained_set3_flag && 
+    (sps.profile_idc == 66 || sps.profile_idc == 77 || sps.profile_idc == 88) ? 9 : sps.level_idc;
+
+  auto i = std::find_if(std::begin(max_dpb_mbs), std::end(max_dpb_mbs), [&](std::pair<unsigned, unsigned> const& a) { return a.first == level_idc; });
+  if(i == std::end(max_dpb_mbs)) return 16;
+
+  auto pic_in_mbs = (sps.pic_width_in_mbs_minus1 + 1)*(sps.pic_height_in_map_units_minus1 + 1)*(sps.frame_mbs_only_flag ? 1 : 2);
+  return std::min(i->second/pic_in_mbs, 16u);
+}
+
+// bitstream_restriction values, inferred as in E.2.1 when absent
+inline unsigned max_dec_frame_buffering(seq_parameter_set const& sps) {
+  if(sps.vui_parameters && sps.vui_parameters->restriction)
+    return sps.vui_parameters->restriction->max_dec_frame_buffering;
+  return MaxDpbFrames(sps);
+}
+
+inline unsigned max_num_reorder_frames(seq_parameter_set const& sps) {
+  if(sps.vui_parameters && sps.vui_parameters->restriction)
+    return sps.vui_parameters->restriction->max_num_reorder_frames;
+
+  // intra profiles have no reordering
+  if(sps.constrained_set3_flag && (sps.profile_idc == 44 || sps.profile_idc == 86 || sps.profile_idc == 100 ||
+      sps.profile_idc == 110 || sps.profile_idc == 122 || sps.profile_idc == 244))
+    return 0;
+
+  return MaxDpbFrames(sps);
+}
+
 struct pic_parameter_set {
   unsigned  pic_parameter_set_id = -1u;
   unsigned  seq_parameter_set_id;
@@ -186,6 +285,42 @@ struct pic_parameter_set {
   utils::optional<scaling_lists> scaling_matrix;
 };
 
+// vector with a fixed capacity stored in place, for slice header lists bounded by the spec
+template<typename T, std::size_t N>
+class inline_vector {
+  std::array<T, N> data;
+  std::size_t n = 0;
+
+public:
+  using value_type = T;
+  using iterator = typename std::array<T, N>::iterator;
+  using const_iterator = typename std::array<T, N>::const_iterator;
+
+  iterator begin() { return data.begin(); }
+  iterator end() { return data.begin() + n; }
+  const_iterator begin() const { return data.begin(); }
+  const_iterator end() const { return data.begin() + n; }
+
+  std::size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  static constexpr std::size_t capacity() { return N; }
+
+  T& operator[](std::size_t i) { return data[i]; }
+  T const& operator[](std::size_t i) const { return data[i]; }
+
+  void clear() { n = 0; }
+
+  void resize(std::size_t size) {
+    if(size > N) throw std::runtime_error("slice header list is too long");
+    n = size;
+  }
+
+  void push_back(T const& v) {
+    if(n == N) throw std::runtime_error("slice header list is too long");
+    data[n++] = v;
+  }
+};
+
 struct memory_management_control_operation {
   unsigned id;
   union {
@@ -217,6 +352,7 @@ struct slice_identity_header {
   unsigned first_mb_in_slice;
   coding_type slice_type;
   unsigned pic_parameter_set_id = -1u;
+  unsigned colour_plane_id = 0;
   picture_type pic_type;
   unsigned idr_pic_id;
 
@@ -232,14 +368,14 @@ struct slice_identity_header {
 };
 
 struct slice_header : slice_identity_header {
-  unsigned colour_plane_id = 0;
   unsigned redundant_pic_cnt;
   bool direct_spatial_mv_pred_flag = false;
   bool num_ref_idx_active_override_flag = false;
   unsigned num_ref_idx_l0_active_minus1;
   unsigned num_ref_idx_l1_active_minus1;
 
-  std::vector<ref_pic_list_modification_operation> ref_pic_list_modification[2];
+  // one operation per reference index, up to 32 for field pictures
+  inline_vector<ref_pic_list_modification_operation, 32> ref_pic_list_modification[2];
 
   unsigned luma_log2_weight_denom = 0;
   unsigned chroma_log2_weight_denom = 0;
@@ -250,11 +386,12 @@ struct slice_header : slice_identity_header {
       std::int8_t offset;
     } luma, cb, cr;
   };
-  std::vector<weight_pred_table_element> weight_pred_table[2];
+  inline_vector<weight_pred_table_element, 32> weight_pred_table[2];
 
   bool no_output_of_prior_pics_flag = false;
   bool long_term_reference_flag = false;
-  std::vector<memory_management_control_operation> mmcos;
+  // two operations for each of the 32 fields in the dpb, and one each of 4 and 5
+  inline_vector<memory_management_control_operation, 66> mmcos;
 
   unsigned cabac_init_idc = 3; // msvd expects cabac_init_idc for i slices
   int slice_qp_delta = 0;
@@ -264,10 +401,27 @@ struct slice_header : slice_identity_header {
   int slice_beta_offset_div2 = 0;
 };
 
+// fnv-1a over the bytes of a parameter set nal unit, repeated sets are recognized by it
+template<typename I>
+std::uint64_t parameter_set_hash(I first, I last) {
+  std::uint64_t h = 0xcbf29ce484222325ull;
+  for(; first != last; ++first) {
+    h ^= std::uint8_t(*first);
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
 struct parsing_context {
   std::vector<utils::optional<seq_parameter_set>> sparams;
   std::vector<utils::optional<pic_parameter_set>> pparams;
 
+  // hashes of the nal units the sets were parsed from, 0 when unknown
+  std::vector<std::uint64_t> shashes;
+  std::vector<std::uint64_t> phashes;
+
+  // changes whenever a parameter set is added or replaced with different content
+  std::uint32_t version = 0;
 
   utils::optional<seq_parameter_set> const& sps(unsigned n) const {
     static const utils::optional<seq_parameter_set> dummy;
@@ -291,17 +445,36 @@ struct parsing_context {
     return pps(s.pic_parameter_set_id);
   }
 
-  friend void add(parsing_context& cx, seq_parameter_set v) {
-    if(cx.sparams.size() <= v.seq_parameter_set_id) cx.sparams.resize(v.seq_parameter_set_id+1);
-    cx.sparams[v.seq_parameter_set_id] = v;
+  bool has_sps(unsigned n, std::uint64_t hash) const { return sps(n) && shashes[n] == hash; }
+  bool has_pps(unsigned n, std::uint64_t hash) const { return pps(n) && phashes[n] == hash; }
+
+  friend void add(parsing_context& cx, seq_parameter_set v, std::uint64_t hash = 0) {
+    auto id = v.seq_parameter_set_id;
+    if(cx.sparams.size() <= id) {
+      cx.sparams.resize(id+1);
+      cx.shashes.resize(id+1);
+    }
+    cx.sparams[id] = std::move(v);
+    cx.shashes[id] = hash;
+    ++cx.version;
+
+    // pic parameter sets of a replaced sps are parsed again even if they repeat
+    for(std::size_t i = 0; i != cx.pparams.size(); ++i)
+      if(cx.pparams[i] && cx.pparams[i]->seq_parameter_set_id == id) cx.phashes[i] = 0;
   }
-  friend void add(parsing_context& cx, utils::optional<seq_parameter_set> v) { if(v) return add(cx, *v); }
+  friend void add(parsing_context& cx, utils::optional<seq_parameter_set> v, std::uint64_t hash = 0) { if(v) return add(cx, std::move(*v), hash); }
 
-  friend void add(parsing_context& cx, pic_parameter_set v) {
-    if(cx.pparams.size() <= v.pic_parameter_set_id) cx.pparams.resize(v.pic_parameter_set_id+1);
-    cx.pparams[v.pic_parameter_set_id] = v;
+  friend void add(parsing_context& cx, pic_parameter_set v, std::uint64_t hash = 0) {
+    auto id = v.pic_parameter_set_id;
+    if(cx.pparams.size() <= id) {
+      cx.pparams.resize(id+1);
+      cx.phashes.resize(id+1);
+    }
+    cx.pparams[id] = std::move(v);
+    cx.phashes[id] = hash;
+    ++cx.version;
   }
-  friend void add(parsing_context& cx, utils::optional<pic_parameter_set> v) { if(v) return add(cx, *v); }
+  friend void add(parsing_context& cx, utils::optional<pic_parameter_set> v, std::uint64_t hash = 0) { if(v) return add(cx, std::move(*v), hash); }
 };
 
 template<typename Source, std::size_t I>
@@ -371,6 +544,26 @@ void parse_scaling_lists(Source& a, unsigned chroma_idc,
     parse_scaling_list(a, (i == 0 || i == 1) ? fallback8x8[i] : list8x8[i-2], default_scaling_lists_8x8[i], list8x8[i]);
 }
 
+template<typename Parser>
+hrd_params parse_hrd(Parser& a) {
+  hrd_params s;
+  auto cpb_cnt_minus1 = ue(a);
+  if(cpb_cnt_minus1 > 31) throw std::runtime_error("cpb_cnt_minus1 > 31");
+  s.cpb_specs.resize(cpb_cnt_minus1 + 1);
+  s.bit_rate_scale = u(a, 4);
+  s.cpb_size_scale = u(a, 4);
+  for(auto& c: s.cpb_specs) {
+    c.bit_rate_value_minus1 = ue(a);
+    c.cpb_size_value_minus1 = ue(a);
+    c.cbr_flag = u(a, 1);
+  }
+  s.initial_cpb_removal_delay_length_minus1 = u(a, 5);
+  s.cpb_removal_delay_length_minus1 = u(a, 5);
+  s.dpb_output_delay_length_minus1 = u(a, 5);
+  s.time_offset_length = u(a, 5);
+  return s;
+}
+
 template<typename Parser>
 vui_params parse_vui(Parser& a) {
   vui_params s;
@@ -399,6 +592,56 @@ vui_params parse_vui(Parser& a) {
     }
     s.aspect_ratio_information = ari;
   }
+
+  if(u(a, 1))
+    s.overscan_appropriate_flag = bool(u(a, 1));
+
+  if(u(a, 1)) {
+    vui_params::video_signal_type vs;
+    vs.video_format = u(a, 3);
+    vs.video_full_range_flag = u(a, 1);
+    if(u(a, 1)) {
+      vs.colour_primaries = u(a, 8);
+      vs.transfer_characteristics = u(a, 8);
+      vs.matrix_coefficients = u(a, 8);
+    }
+    s.video_signal = vs;
+  }
+
+  if(u(a, 1)) {
+    vui_params::chroma_loc_info cl;
+    cl.chroma_sample_loc_type_top_field = ue(a);
+    cl.chroma_sample_loc_type_bottom_field = ue(a);
+    s.chroma_location = cl;
+  }
+
+  if(u(a, 1)) {
+    vui_params::timing_info ti;
+    ti.num_units_in_tick = u(a, 32);
+    ti.time_scale = u(a, 32);
+    ti.fixed_frame_rate_flag = u(a, 1);
+    s.timing = ti;
+  }
+
+  if(u(a, 1)) s.nal_hrd_parameters = parse_hrd(a);
+  if(u(a, 1)) s.vcl_hrd_parameters = parse_hrd(a);
+  if(s.nal_hrd_parameters || s.vcl_hrd_parameters)
+    s.low_delay_hrd_flag = u(a, 1);
+
+  s.pic_struct_present_flag = u(a, 1);
+
+  if(u(a, 1)) {
+    vui_params::bitstream_restriction br;
+    br.motion_vectors_over_pic_boundaries_flag = u(a, 1);
+    br.max_bytes_per_pic_denom = ue(a);
+    br.max_bits_per_mb_denom = ue(a);
+    br.log2_max_mv_length_horizontal = ue(a);
+    br.log2_max_mv_length_vertical = ue(a);
+    br.max_num_reorder_frames = ue(a);
+    br.max_dec_frame_buffering = ue(a);
+    s.restriction = br;
+  }
+
   return s;
 }
 
@@ -517,9 +760,11 @@ utils::optional<pic_parameter_set> parse_pps(parsing_context const& cx, Parser&
   return pps;
 }
 
+// First phase of slice header parsing: the fields up to the picture order count, enough to
+// detect the first slice of a picture and to decide whether the slice is decoded at all.
 template<typename Parser>
-utils::optional<slice_header> parse_slice_header(parsing_context const& cx, Parser& a, unsigned nal_unit_type, unsigned nal_ref_idc) {
-  slice_header slice;
+utils::optional<slice_identity_header> parse_slice_identity_header(parsing_context const& cx, Parser& a, unsigned nal_unit_type, unsigned nal_ref_idc) {
+  slice_identity_header slice;
 
   slice.IdrPicFlag = nal_unit_type == 5;
   slice.nal_ref_idc = nal_ref_idc;
@@ -561,6 +806,21 @@ utils::optional<slice_header> parse_slice_header(parsing_context const& cx, Pars
     slice.delta_pic_order_cnt[0] = slice.delta_pic_order_cnt[1] = 0;
   }
 
+  return slice;
+}
+
+// Second phase: the rest of the header, parsed from where parse_slice_identity_header stopped.
+template<typename Parser>
+slice_header parse_slice_header(parsing_context const& cx, Parser& a, slice_identity_header const& id) {
+  slice_header slice;
+  static_cast<slice_identity_header&>(slice) = id;
+
+  auto& pps = cx.pps(slice.pic_parameter_set_id);
+  auto& sps = *cx.sps(pps->seq_parameter_set_id);
+
+  if(pps->redundant_pic_cnt_present_flag)
+    slice.redundant_pic_cnt = ue(a);
+
   slice.direct_spatial_mv_pred_flag =  slice.slice_type == coding_type::B ? u(a, 1) : false;
 
   if(slice.slice_type == coding_type::P || slice.slice_type == coding_type::B) {
@@ -574,7 +834,7 @@ utils::optional<slice_header> parse_slice_header(parsing_context const& cx, Pars
     }
   }
 
-  auto ref_pic_list_modification = [&](std::vector<ref_pic_list_modification_operation>& ops) {
+  auto ref_pic_list_modification = [&](decltype(slice.ref_pic_list_modification[0])& ops) {
     for(;;) {
       auto modification_of_pic_nums_idc = ue(a);
       if(modification_of_pic_nums_idc == 3) break;
@@ -668,6 +928,13 @@ utils::optional<slice_header> parse_slice_header(parsing_context const& cx, Pars
   return slice;
 }
 
+template<typename Parser>
+utils::optional<slice_header> parse_slice_header(parsing_context const& cx, Parser& a, unsigned nal_unit_type, unsigned nal_ref_idc) {
+  auto id = parse_slice_identity_header(cx, a, nal_unit_type, nal_ref_idc);
+  if(!id) return utils::nullopt;
+  return parse_slice_header(cx, a, *id);
+}
+
 inline bool has_mmco5(slice_header const& s) {
   return std::any_of(s.mmcos.begin(), s.mmcos.end(), [](memory_management_control_operation const& o) { return o.id == 5; });
 }
@@ -1,6 +1,12 @@
 #include "msvd.hpp"
 #include "video.hpp"
 
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <functional>
+
 namespace media {namespace mpeg {
 
 struct access_unit_tag {};
@@ -62,20 +68,123 @@ utils::future<void> async_decode_picture(decoder& d,
       std::get<0>(buffers).get(), std::get<1>(buffers).get(), std::get<2>(buffers).get(), std::move(data));
   });
 }
+
+// Submits mpeg pictures to the decoder in decoding order. A picture's decoding parameters
+// are prepared when it is pushed; it is submitted once its frame buffers are allocated and
+// every picture pushed before it has been submitted. Every picture also waits for the previous
+// one to complete, unless the backend executes requests in order (executes_in_order), then
+// references only need to be submitted and pictures go out back to back while earlier ones
+// decode. Decoder is any backend with an async_decode_picture overload for mpeg_context.
+template<typename Frame, typename Decoder = decoder>
+struct mpeg_submission_queue {
+  using buffer_type = std::decay_t<decltype(std::declval<Frame>().get())>;
+
+  mpeg_submission_queue(Decoder& d, bool in_order = executes_in_order<Decoder>::value) : d(d), in_order(in_order) {}
+
+  mpeg_submission_queue(mpeg_submission_queue const&) = delete;
+  mpeg_submission_queue& operator=(mpeg_submission_queue const&) = delete;
+
+  template<typename Data>
+  utils::future<void> push(
+    mpeg::sequence_header_t const& sh,
+    mpeg::picture_header_t const& ph,
+    utils::optional<mpeg::picture_coding_extension_t> const& pcx,
+    utils::optional<mpeg::quant_matrix_extension_t> const& qmx,
+    Frame curpic,
+    Frame ref1,
+    Frame ref2,
+    media::mpeg::picture_data<Data> data)
+  {
+    auto s = as_asio_sequence(data);
+    using context_type = detail::mpeg_context<buffer_type, decltype(s)>;
+
+    auto cx = utils::move_on_copy(std::unique_ptr<context_type>(new context_type(sh, ph, pcx ? &*pcx : 0, qmx ? &*qmx : 0, s)));
+    auto e = std::make_shared<entry>();
+    auto p = std::make_shared<utils::promise<void>>();
+    auto r = p->get_future();
+
+    pending.push_back(e);
+
+    ref1 = ref1.valid() ? ref1 : utils::make_ready_future(buffer_type());
+    ref2 = ref2.valid() ? ref2 : utils::make_ready_future(buffer_type());
+
+    when_all(curpic, ref1, ref2).then([this, e, p, cx, data = utils::move_on_copy(std::move(data))](auto bfrs) mutable {
+      try {
+        auto buffers = bfrs.get();
+        unwrap(cx)->bind(std::get<0>(buffers).get(), std::get<1>(buffers).get(), std::get<2>(buffers).get());
+
+        e->submit = [this, p, cx, data]() mutable {
+          async_decode_picture(d, std::move(unwrap(cx)), [this, p, data](std::error_code const& ec, decode_result) {
+            if(ec)
+              p->set_exception(std::make_exception_ptr(std::system_error(ec)));
+            else
+              p->set_value();
+            completed();
+          });
+        };
+      }
+      catch(...) {
+        p->set_exception(std::current_exception());
+      }
+
+      e->ready = true;
+      submit();
+    });
+
+    return r;
+  }
+
+  std::size_t in_flight() const { return submitted; }
+  std::size_t waiting() const { return pending.size(); }
+
+private:
+  struct entry {
+    bool ready = false;
+    std::function<void()> submit;
+  };
+
+  void submit() {
+    while(!pending.empty() && pending.front()->ready && (in_order || submitted == 0)) {
+      auto e = std::move(pending.front());
+      pending.pop_front();
+
+      if(e->submit) {
+        ++submitted;
+        e->submit();
+      }
+    }
+  }
+
+  void completed() {
+    --submitted;
+    if(!in_order) submit();
+  }
+
+  Decoder& d;
+  bool in_order;
+  std::deque<std::shared_ptr<entry>> pending;
+  std::size_t submitted = 0;
+};
 }
 
 namespace mpeg {
 
-template<typename Allocator, typename Sink>
+template<typename Allocator, typename Sink, typename Backend = msvd::decoder>
 struct decoder {
-  std::unique_ptr<msvd::decoder> hw;
+  std::unique_ptr<Backend> hw;
   Allocator frame_source;
   Sink sink; 
 
-  decoder(asio::io_service& io, Allocator fsrc, Sink sk) : hw(new msvd::decoder(io)), frame_source(fsrc), sink(sk) {}
+  // backend_args follow io to the constructor of the backend
+  template<typename... A>
+  decoder(asio::io_service& io, Allocator fsrc, Sink sk, A&&... backend_args) : hw(new Backend(io, std::forward<A>(backend_args)...)), frame_source(fsrc), sink(sk),
+    queue(new msvd::mpeg_submission_queue<frame_type, Backend>(*hw)) {}
 
   using frame_type = std::decay_t<decltype(pull(frame_source))>;
 
+  // held by pointer like hw, its continuations refer to it while the decoder may be moved
+  std::unique_ptr<msvd::mpeg_submission_queue<frame_type, Backend>> queue;
+
   struct stored_frame {
     mpeg::picture_type pt;
     frame_type frame; 
@@ -83,6 +192,33 @@ struct decoder {
 
   utils::optional<stored_frame> frames[3];
   utils::optional<sequence_header_t> sh;
+  std::vector<std::uint8_t> raw_sh;
+
+  bool intra_only = false;
+  bool resync = false;
+
+  // Trick play decodes only I pictures (and the second field of an I frame). Leaving it
+  // drops the references, so decoding resumes at the next I picture and B pictures wait
+  // for both of their references.
+  friend void set_trick_play(decoder& d, bool on) {
+    if(d.intra_only && !on) {
+      d.frames[1] = utils::nullopt;
+      d.frames[2] = utils::nullopt;
+      d.resync = true;
+    }
+    d.intra_only = on;
+  }
+
+  template<typename I>
+  bool accept_picture(I first) const {
+    if(frames[0] && frames[0]->pt != mpeg::picture_type::frame) return true;
+
+    auto coding = peek_picture_coding_type(first);
+    if(coding == mpeg::picture_coding::I) return true;
+    if(intra_only) return false;
+    if(resync) return frames[1] && (coding != mpeg::picture_coding::B || frames[2]);
+    return true;
+  }
 
   template<typename BS>
   struct parsed_picture {
@@ -114,10 +250,8 @@ struct decoder {
         else
           mpeg::unknown_extension(parser);
       }
-      else if(startcode == (0x00000100 | mpeg::user_data_start_code)) {
-        while(next_bits(parser, 24) != 1)
-          u(parser, 8);
-      }
+      else if(startcode == (0x00000100 | mpeg::user_data_start_code))
+        skip_to_next_start_code(parser);
       else
         break;
     }
@@ -139,7 +273,7 @@ struct decoder {
     else
       frames[0] = stored_frame{pt, pull(frame_source)};
   
-    auto f = msvd::async_decode_picture(*hw, *sh, p.ph, p.pcx, p.qmx,
+    auto f = queue->push(*sh, p.ph, p.pcx, p.qmx,
       frames[0]->frame, frames[1] ? frames[1]->frame : frame_type(), frames[2] ? frames[2]->frame : frame_type(),
       std::move(p.data)
     );
@@ -151,37 +285,53 @@ struct decoder {
       });
  
       if(p.ph.picture_coding_type != mpeg::picture_coding::B) std::move_backward(&frames[0], &frames[2], &frames[3]);
+      if(frames[2]) resync = false;
     }
 
     return f;
   }
 
+  // splits the access unit at sequence and picture headers in one pass and submits every
+  // picture, the result completes when all of them are decoded
   template<typename Data>
   friend utils::future<void> push(decoder& d, timestamp ts, access_unit<Data> data) {
-    if(begin(data) == end(data)) return utils::make_ready_future();    
-    
-    auto p = split(std::move(data), find_next_sequence_or_picture_header(begin(data), end(data)));
+    std::vector<utils::future<void>> pictures;
 
-    if(*(begin(p.first) + 3) == mpeg::sequence_header_code) {
-      d.sh = mpeg::sequence_header(bitstream::make_bit_parser(bitstream::make_bit_range(utils::make_range(begin(p.first)+4, end(p.first)))));
-      set_dimensions(d.sink, video::resolution{d.sh->horizontal_size_value, d.sh->vertical_size_value}, video::aspect_ratio{1.0});
-    }
-    else if(d.sh) {
-      auto a = d.decode_picture(ts, utils::tag<picture_data_tag>(std::move(p.first)));
-      return when_all(
-        std::move(a),
-        push(d, ts, utils::tag<access_unit_tag>(std::move(p.second)))
-      ).then([](auto f) { f.get(); });
+    while(begin(data) != end(data)) {
+      auto p = split(std::move(data), find_next_sequence_or_picture_header(begin(data), end(data)));
+      data = utils::tag<access_unit_tag>(std::move(p.second));
+
+      if(*(begin(p.first) + 3) == mpeg::sequence_header_code) {
+        // the sequence header is repeated before every gop, reparse it and reconfigure the sink
+        // only when its bytes differ from the cached ones
+        auto first = begin(p.first) + 4;
+        auto last = bitstream::find_startcode_prefix(first, end(p.first));
+        if(d.sh && std::equal(first, last, d.raw_sh.begin(), d.raw_sh.end())) continue;
+
+        auto prev = d.sh;
+        d.sh = mpeg::sequence_header(bitstream::make_bit_parser(bitstream::make_bit_range(utils::make_range(first, end(p.first)))));
+        d.raw_sh.assign(first, last);
+
+        if(!prev || prev->horizontal_size_value != d.sh->horizontal_size_value || prev->vertical_size_value != d.sh->vertical_size_value)
+          set_dimensions(d.sink, video::resolution{d.sh->horizontal_size_value, d.sh->vertical_size_value}, video::aspect_ratio{1.0});
+      }
+      else if(d.sh && d.accept_picture(begin(p.first)))
+        pictures.push_back(d.decode_picture(ts, utils::tag<picture_data_tag>(std::move(p.first))));
     }
 
-    return push(d, ts, utils::tag<access_unit_tag>(std::move(p.second)));
+    if(pictures.empty()) return utils::make_ready_future();
+    if(pictures.size() == 1) return std::move(pictures.front());
+
+    return when_all(pictures.begin(), pictures.end()).then([](auto f) { 
+      for(auto& p: f.get()) p.get(); 
+    });
   }
 };
 
 
-template<typename Source, typename Sink>
-auto make_decoder(asio::io_service& io, Source src, Sink sk) {
-  return decoder<Source, Sink>(io, std::move(src), std::move(sk));
+template<typename Backend = msvd::decoder, typename Source, typename Sink, typename... A>
+auto make_decoder(asio::io_service& io, Source src, Sink sk, A&&... backend_args) {
+  return decoder<Source, Sink, Backend>(io, std::move(src), std::move(sk), std::forward<A>(backend_args)...);
 }
 
 }
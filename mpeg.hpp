@@ -4,6 +4,7 @@
 #include <exception>
 #include <array>
 #include <cassert>
+#include <algorithm>
 
 #include "bitstream.hpp"
 
@@ -18,8 +19,9 @@ template<typename S>
 void next_start_code(S& s) {
   while(!byte_aligned(s)) if(u(s, 1)) 
     throw parse_error();
-  while(more_data(s) && next_bits(s, 24) != 0x000001) 
-    if(u(s, 8)) throw parse_error();
+  auto stuffing = skip_to_next_start_code(s);
+  if(std::any_of(stuffing.begin(), stuffing.end(), [](std::uint8_t b) { return b != 0; })) 
+    throw parse_error();
 }
 
 enum header_codes_t {
@@ -275,16 +277,14 @@ void unknown_extension(S& s) {
 
   assert(byte_aligned(s));
 
-  while(next_bits(s, 24) != 1)
-    u(s, 8);
+  skip_to_next_start_code(s);
 }
 
 template<typename S>
 void unknown_high_level_syntax_element(S&& s) {
   assert(byte_aligned(s));
 
-  while(more_data(s) && next_bits(s, 24) != 1)
-    u(s, 8);
+  skip_to_next_start_code(s);
 }
 
 // various helpers
@@ -298,6 +298,14 @@ I find_sequence_or_picture_header(I first, I last) {
   }
 }
 
+// picture_coding_type of the picture header starting at first (with its start code),
+// read directly from the header bytes
+template<typename I>
+picture_coding peek_picture_coding_type(I first) {
+  std::advance(first, 5);
+  return picture_coding((*first >> 3) & 7);
+}
+
 template<typename I>
 I find_next_sequence_or_picture_header(I first, I last) {
   auto i = find_sequence_or_picture_header(first, last);
@@ -0,0 +1,1224 @@
+#ifndef __MSVD_SOFTWARE_HPP_8e0d6b2c_41f7_4a3e_b9d5_07c2f6a1e354__
+#define __MSVD_SOFTWARE_HPP_8e0d6b2c_41f7_4a3e_b9d5_07c2f6a1e354__
+
+#include "msvd.hpp"
+#include "mpeg.hpp"
+#include "bitstream.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <functional>
+#include <system_error>
+
+#ifndef ASIO_DISABLE_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#endif
+
+// CPU implementation of the msvd mpeg decoding interface. It consumes the same mpeg_context
+// as the hardware and writes the same macroblock tiled frames: luma in 16x16 tiles of 256
+// bytes and interleaved CbCr in 8 rows of 16 bytes per macroblock, tiles in raster order
+// with buffer_traits<Buffer>::width / 16 tiles per row. Frame buffers must provide
+// luma_buffer(b) and chroma_buffer(b) with CPU addresses of the two planes.
+
+namespace media {
+namespace msvd {
+namespace software {
+namespace detail {
+
+struct vlc_code {
+  std::uint16_t code;
+  std::uint8_t length;
+  std::int16_t value;
+};
+
+// Two level lookup over the next 16 bits of the stream: codes up to 9 bits are resolved by
+// the first level, longer ones by 128 entry second level tables.
+class vlc_table {
+  struct entry {
+    std::int16_t value;
+    std::uint8_t length;
+    std::uint8_t sub;
+  };
+
+  std::array<entry, 512> primary = {};
+  std::vector<std::array<entry, 128>> secondary;
+
+public:
+  template<std::size_t N>
+  explicit vlc_table(vlc_code const (&codes)[N]) {
+    for(auto const& c: codes) {
+      if(c.length <= 9) {
+        auto first = c.code << (9 - c.length);
+        for(auto i = 0u; i != 1u << (9 - c.length); ++i)
+          primary[first + i] = entry{c.value, c.length, 0};
+      }
+      else {
+        auto& p = primary[c.code >> (c.length - 9)];
+        if(!p.sub) {
+          secondary.emplace_back();
+          secondary.back().fill(entry{0, 0, 0});
+          p.sub = secondary.size();
+        }
+
+        auto first = (c.code & ((1u << (c.length - 9)) - 1)) << (16 - c.length);
+        for(auto i = 0u; i != 1u << (16 - c.length); ++i)
+          secondary[p.sub - 1][first + i] = entry{c.value, c.length, 0};
+      }
+    }
+  }
+
+  template<typename I>
+  friend int read_vlc(bitstream::bit_parser<I>& bits, vlc_table const& t) {
+    auto b = next_bits(bits, 16);
+    auto e = t.primary[b >> 7];
+    if(e.sub) e = t.secondary[e.sub - 1][b & 0x7f];
+    if(!e.length) throw mpeg::parse_error();
+    u(bits, e.length);
+    return e.value;
+  }
+};
+
+enum : std::int16_t { vlc_escape = -1, vlc_stuffing = -2, vlc_eob = -3 };
+
+// B.1 macroblock_address_increment
+constexpr vlc_code macroblock_address_increment_codes[] = {
+  {0x1, 1, 1}, {0x3, 3, 2}, {0x2, 3, 3}, {0x3, 4, 4}, {0x2, 4, 5}, {0x3, 5, 6}, {0x2, 5, 7},
+  {0x7, 7, 8}, {0x6, 7, 9}, {0xb, 8, 10}, {0xa, 8, 11}, {0x9, 8, 12}, {0x8, 8, 13},
+  {0x7, 8, 14}, {0x6, 8, 15}, {0x17, 10, 16}, {0x16, 10, 17}, {0x15, 10, 18}, {0x14, 10, 19},
+  {0x13, 10, 20}, {0x12, 10, 21}, {0x23, 11, 22}, {0x22, 11, 23}, {0x21, 11, 24}, {0x20, 11, 25},
+  {0x1f, 11, 26}, {0x1e, 11, 27}, {0x1d, 11, 28}, {0x1c, 11, 29}, {0x1b, 11, 30}, {0x1a, 11, 31},
+  {0x19, 11, 32}, {0x18, 11, 33}, {0xf, 11, vlc_stuffing}, {0x8, 11, vlc_escape}
+};
+
+enum macroblock_flags {
+  macroblock_quant = 1,
+  macroblock_motion_forward = 2,
+  macroblock_motion_backward = 4,
+  macroblock_pattern = 8,
+  macroblock_intra = 16
+};
+
+// B.2 - B.4 macroblock_type for I, P and B pictures
+constexpr vlc_code macroblock_type_i_codes[] = {
+  {0x1, 1, macroblock_intra}, {0x1, 2, macroblock_quant | macroblock_intra}
+};
+
+constexpr vlc_code macroblock_type_p_codes[] = {
+  {0x1, 1, macroblock_motion_forward | macroblock_pattern},
+  {0x1, 2, macroblock_pattern},
+  {0x1, 3, macroblock_motion_forward},
+  {0x3, 5, macroblock_intra},
+  {0x2, 5, macroblock_quant | macroblock_motion_forward | macroblock_pattern},
+  {0x1, 5, macroblock_quant | macroblock_pattern},
+  {0x1, 6, macroblock_quant | macroblock_intra}
+};
+
+constexpr vlc_code macroblock_type_b_codes[] = {
+  {0x2, 2, macroblock_motion_forward | macroblock_motion_backward},
+  {0x3, 2, macroblock_motion_forward | macroblock_motion_backward | macroblock_pattern},
+  {0x2, 3, macroblock_motion_backward},
+  {0x3, 3, macroblock_motion_backward | macroblock_pattern},
+  {0x2, 4, macroblock_motion_forward},
+  {0x3, 4, macroblock_motion_forward | macroblock_pattern},
+  {0x3, 5, macroblock_intra},
+  {0x2, 5, macroblock_quant | macroblock_motion_forward | macroblock_motion_backward | macroblock_pattern},
+  {0x3, 6, macroblock_quant | macroblock_motion_forward | macroblock_pattern},
+  {0x2, 6, macroblock_quant | macroblock_motion_backward | macroblock_pattern},
+  {0x1, 6, macroblock_quant | macroblock_intra}
+};
+
+// B.9 coded_block_pattern for 4:2:0
+constexpr vlc_code coded_block_pattern_codes[] = {
+  {0x7, 3, 60}, {0xd, 4, 4}, {0xc, 4, 8}, {0xb, 4, 16}, {0xa, 4, 32},
+  {0x13, 5, 12}, {0x12, 5, 48}, {0x11, 5, 20}, {0x10, 5, 40}, {0xf, 5, 28}, {0xe, 5, 44},
+  {0xd, 5, 52}, {0xc, 5, 56}, {0xb, 5, 1}, {0xa, 5, 61}, {0x9, 5, 2}, {0x8, 5, 62},
+  {0xf, 6, 24}, {0xe, 6, 36}, {0xd, 6, 3}, {0xc, 6, 63},
+  {0x17, 7, 5}, {0x16, 7, 9}, {0x15, 7, 17}, {0x14, 7, 33}, {0x13, 7, 6}, {0x12, 7, 10}, {0x11, 7, 18}, {0x10, 7, 34},
+  {0x1f, 8, 7}, {0x1e, 8, 11}, {0x1d, 8, 19}, {0x1c, 8, 35}, {0x1b, 8, 13}, {0x1a, 8, 49}, {0x19, 8, 21}, {0x18, 8, 41},
+  {0x17, 8, 14}, {0x16, 8, 50}, {0x15, 8, 22}, {0x14, 8, 42}, {0x13, 8, 15}, {0x12, 8, 51}, {0x11, 8, 23}, {0x10, 8, 43},
+  {0xf, 8, 25}, {0xe, 8, 37}, {0xd, 8, 26}, {0xc, 8, 38}, {0xb, 8, 29}, {0xa, 8, 45}, {0x9, 8, 53}, {0x8, 8, 57},
+  {0x7, 8, 30}, {0x6, 8, 46}, {0x5, 8, 54}, {0x4, 8, 58},
+  {0x7, 9, 31}, {0x6, 9, 47}, {0x5, 9, 55}, {0x4, 9, 59}, {0x3, 9, 27}, {0x2, 9, 39}, {0x1, 9, 0}
+};
+
+// B.10 motion_code, the sign bit follows the code
+constexpr vlc_code motion_code_codes[] = {
+  {0x1, 1, 0}, {0x1, 2, 1}, {0x1, 3, 2}, {0x1, 4, 3}, {0x3, 6, 4}, {0x5, 7, 5}, {0x4, 7, 6}, {0x3, 7, 7},
+  {0xb, 9, 8}, {0xa, 9, 9}, {0x9, 9, 10}, {0x11, 10, 11}, {0x10, 10, 12}, {0xf, 10, 13}, {0xe, 10, 14},
+  {0xd, 10, 15}, {0xc, 10, 16}
+};
+
+// B.12, B.13 dct_dc_size
+constexpr vlc_code dct_dc_size_luminance_codes[] = {
+  {0x4, 3, 0}, {0x0, 2, 1}, {0x1, 2, 2}, {0x5, 3, 3}, {0x6, 3, 4}, {0xe, 4, 5}, {0x1e, 5, 6},
+  {0x3e, 6, 7}, {0x7e, 7, 8}, {0xfe, 8, 9}, {0x1fe, 9, 10}, {0x1ff, 9, 11}
+};
+
+constexpr vlc_code dct_dc_size_chrominance_codes[] = {
+  {0x0, 2, 0}, {0x1, 2, 1}, {0x2, 2, 2}, {0x6, 3, 3}, {0xe, 4, 4}, {0x1e, 5, 5}, {0x3e, 6, 6},
+  {0x7e, 7, 7}, {0xfe, 8, 8}, {0x1fe, 9, 9}, {0x3fe, 10, 10}, {0x3ff, 10, 11}
+};
+
+constexpr std::int16_t run_level(int run, int level) { return (run << 8) | level; }
+
+// B.14 dct coefficients table zero without the sign bit, the first coefficient of non intra
+// blocks uses '1' for run 0 level 1 and is handled by the caller
+constexpr vlc_code dct_coefficients_zero_codes[] = {
+  {0x2, 2, vlc_eob}, {0x3, 2, run_level(0, 1)}, {0x3, 3, run_level(1, 1)}, {0x4, 4, run_level(0, 2)},
+  {0x5, 4, run_level(2, 1)}, {0x5, 5, run_level(0, 3)}, {0x7, 5, run_level(3, 1)}, {0x6, 5, run_level(4, 1)},
+  {0x6, 6, run_level(1, 2)}, {0x7, 6, run_level(5, 1)}, {0x5, 6, run_level(6, 1)}, {0x4, 6, run_level(7, 1)},
+  {0x6, 7, run_level(0, 4)}, {0x4, 7, run_level(2, 2)}, {0x7, 7, run_level(8, 1)}, {0x5, 7, run_level(9, 1)},
+  {0x1, 6, vlc_escape},
+  {0x26, 8, run_level(0, 5)}, {0x21, 8, run_level(0, 6)}, {0x25, 8, run_level(1, 3)}, {0x24, 8, run_level(3, 2)},
+  {0x27, 8, run_level(10, 1)}, {0x23, 8, run_level(11, 1)}, {0x22, 8, run_level(12, 1)}, {0x20, 8, run_level(13, 1)},
+  {0xa, 10, run_level(0, 7)}, {0xc, 10, run_level(1, 4)}, {0xb, 10, run_level(2, 3)}, {0xf, 10, run_level(4, 2)},
+  {0x9, 10, run_level(5, 2)}, {0xe, 10, run_level(14, 1)}, {0xd, 10, run_level(15, 1)}, {0x8, 10, run_level(16, 1)},
+  {0x1d, 12, run_level(0, 8)}, {0x18, 12, run_level(0, 9)}, {0x13, 12, run_level(0, 10)}, {0x10, 12, run_level(0, 11)},
+  {0x1b, 12, run_level(1, 5)}, {0x14, 12, run_level(2, 4)}, {0x1c, 12, run_level(3, 3)}, {0x12, 12, run_level(4, 3)},
+  {0x1e, 12, run_level(6, 2)}, {0x15, 12, run_level(7, 2)}, {0x11, 12, run_level(8, 2)}, {0x1f, 12, run_level(17, 1)},
+  {0x1a, 12, run_level(18, 1)}, {0x19, 12, run_level(19, 1)}, {0x17, 12, run_level(20, 1)}, {0x16, 12, run_level(21, 1)},
+  {0x1a, 13, run_level(0, 12)}, {0x19, 13, run_level(0, 13)}, {0x18, 13, run_level(0, 14)}, {0x17, 13, run_level(0, 15)},
+  {0x16, 13, run_level(1, 6)}, {0x15, 13, run_level(1, 7)}, {0x14, 13, run_level(2, 5)}, {0x13, 13, run_level(3, 4)},
+  {0x12, 13, run_level(5, 3)}, {0x11, 13, run_level(9, 2)}, {0x10, 13, run_level(10, 2)}, {0x1f, 13, run_level(22, 1)},
+  {0x1e, 13, run_level(23, 1)}, {0x1d, 13, run_level(24, 1)}, {0x1c, 13, run_level(25, 1)}, {0x1b, 13, run_level(26, 1)},
+  {0x1f, 14, run_level(0, 16)}, {0x1e, 14, run_level(0, 17)}, {0x1d, 14, run_level(0, 18)}, {0x1c, 14, run_level(0, 19)},
+  {0x1b, 14, run_level(0, 20)}, {0x1a, 14, run_level(0, 21)}, {0x19, 14, run_level(0, 22)}, {0x18, 14, run_level(0, 23)},
+  {0x17, 14, run_level(0, 24)}, {0x16, 14, run_level(0, 25)}, {0x15, 14, run_level(0, 26)}, {0x14, 14, run_level(0, 27)},
+  {0x13, 14, run_level(0, 28)}, {0x12, 14, run_level(0, 29)}, {0x11, 14, run_level(0, 30)}, {0x10, 14, run_level(0, 31)},
+  {0x18, 15, run_level(0, 32)}, {0x17, 15, run_level(0, 33)}, {0x16, 15, run_level(0, 34)}, {0x15, 15, run_level(0, 35)},
+  {0x14, 15, run_level(0, 36)}, {0x13, 15, run_level(0, 37)}, {0x12, 15, run_level(0, 38)}, {0x11, 15, run_level(0, 39)},
+  {0x10, 15, run_level(0, 40)}, {0x1f, 15, run_level(1, 8)}, {0x1e, 15, run_level(1, 9)}, {0x1d, 15, run_level(1, 10)},
+  {0x1c, 15, run_level(1, 11)}, {0x1b, 15, run_level(1, 12)}, {0x1a, 15, run_level(1, 13)}, {0x19, 15, run_level(1, 14)},
+  {0x13, 16, run_level(1, 15)}, {0x12, 16, run_level(1, 16)}, {0x11, 16, run_level(1, 17)}, {0x10, 16, run_level(1, 18)},
+  {0x14, 16, run_level(6, 3)}, {0x1a, 16, run_level(11, 2)}, {0x19, 16, run_level(12, 2)}, {0x18, 16, run_level(13, 2)},
+  {0x17, 16, run_level(14, 2)}, {0x16, 16, run_level(15, 2)}, {0x15, 16, run_level(16, 2)}, {0x1f, 16, run_level(27, 1)},
+  {0x1e, 16, run_level(28, 1)}, {0x1d, 16, run_level(29, 1)}, {0x1c, 16, run_level(30, 1)}, {0x1b, 16, run_level(31, 1)}
+};
+
+// B.15 dct coefficients table one without the sign bit, used for intra blocks with intra_vlc_format
+constexpr vlc_code dct_coefficients_one_codes[] = {
+  {0x6, 4, vlc_eob}, {0x2, 2, run_level(0, 1)}, {0x2, 3, run_level(1, 1)}, {0x6, 3, run_level(0, 2)},
+  {0x5, 5, run_level(2, 1)}, {0x7, 4, run_level(0, 3)}, {0x7, 5, run_level(3, 1)}, {0x6, 6, run_level(4, 1)},
+  {0x6, 5, run_level(1, 2)}, {0x7, 6, run_level(5, 1)}, {0x6, 7, run_level(6, 1)}, {0x4, 7, run_level(7, 1)},
+  {0x1c, 5, run_level(0, 4)}, {0x7, 7, run_level(2, 2)}, {0x5, 7, run_level(8, 1)}, {0x78, 7, run_level(9, 1)},
+  {0x1, 6, vlc_escape},
+  {0x1d, 5, run_level(0, 5)}, {0x5, 6, run_level(0, 6)}, {0x79, 7, run_level(1, 3)}, {0x26, 8, run_level(3, 2)},
+  {0x7a, 7, run_level(10, 1)}, {0x21, 8, run_level(11, 1)}, {0x25, 8, run_level(12, 1)}, {0x24, 8, run_level(13, 1)},
+  {0x4, 6, run_level(0, 7)}, {0x27, 8, run_level(1, 4)}, {0xfc, 8, run_level(2, 3)}, {0xfd, 8, run_level(4, 2)},
+  {0x4, 9, run_level(5, 2)}, {0x5, 9, run_level(14, 1)}, {0x7, 9, run_level(15, 1)}, {0xd, 10, run_level(16, 1)},
+  {0x7b, 7, run_level(0, 8)}, {0x7c, 7, run_level(0, 9)}, {0x23, 8, run_level(0, 10)}, {0x22, 8, run_level(0, 11)},
+  {0x20, 8, run_level(1, 5)}, {0xc, 10, run_level(2, 4)}, {0x1c, 12, run_level(3, 3)}, {0x12, 12, run_level(4, 3)},
+  {0x1e, 12, run_level(6, 2)}, {0x15, 12, run_level(7, 2)}, {0x11, 12, run_level(8, 2)}, {0x1f, 12, run_level(17, 1)},
+  {0x1a, 12, run_level(18, 1)}, {0x19, 12, run_level(19, 1)}, {0x17, 12, run_level(20, 1)}, {0x16, 12, run_level(21, 1)},
+  {0xfa, 8, run_level(0, 12)}, {0xfb, 8, run_level(0, 13)}, {0xfe, 8, run_level(0, 14)}, {0xff, 8, run_level(0, 15)},
+  {0x16, 13, run_level(1, 6)}, {0x15, 13, run_level(1, 7)}, {0x14, 13, run_level(2, 5)}, {0x13, 13, run_level(3, 4)},
+  {0x12, 13, run_level(5, 3)}, {0x11, 13, run_level(9, 2)}, {0x10, 13, run_level(10, 2)}, {0x1f, 13, run_level(22, 1)},
+  {0x1e, 13, run_level(23, 1)}, {0x1d, 13, run_level(24, 1)}, {0x1c, 13, run_level(25, 1)}, {0x1b, 13, run_level(26, 1)},
+  {0x1f, 14, run_level(0, 16)}, {0x1e, 14, run_level(0, 17)}, {0x1d, 14, run_level(0, 18)}, {0x1c, 14, run_level(0, 19)},
+  {0x1b, 14, run_level(0, 20)}, {0x1a, 14, run_level(0, 21)}, {0x19, 14, run_level(0, 22)}, {0x18, 14, run_level(0, 23)},
+  {0x17, 14, run_level(0, 24)}, {0x16, 14, run_level(0, 25)}, {0x15, 14, run_level(0, 26)}, {0x14, 14, run_level(0, 27)},
+  {0x13, 14, run_level(0, 28)}, {0x12, 14, run_level(0, 29)}, {0x11, 14, run_level(0, 30)}, {0x10, 14, run_level(0, 31)},
+  {0x18, 15, run_level(0, 32)}, {0x17, 15, run_level(0, 33)}, {0x16, 15, run_level(0, 34)}, {0x15, 15, run_level(0, 35)},
+  {0x14, 15, run_level(0, 36)}, {0x13, 15, run_level(0, 37)}, {0x12, 15, run_level(0, 38)}, {0x11, 15, run_level(0, 39)},
+  {0x10, 15, run_level(0, 40)}, {0x1f, 15, run_level(1, 8)}, {0x1e, 15, run_level(1, 9)}, {0x1d, 15, run_level(1, 10)},
+  {0x1c, 15, run_level(1, 11)}, {0x1b, 15, run_level(1, 12)}, {0x1a, 15, run_level(1, 13)}, {0x19, 15, run_level(1, 14)},
+  {0x13, 16, run_level(1, 15)}, {0x12, 16, run_level(1, 16)}, {0x11, 16, run_level(1, 17)}, {0x10, 16, run_level(1, 18)},
+  {0x14, 16, run_level(6, 3)}, {0x1a, 16, run_level(11, 2)}, {0x19, 16, run_level(12, 2)}, {0x18, 16, run_level(13, 2)},
+  {0x17, 16, run_level(14, 2)}, {0x16, 16, run_level(15, 2)}, {0x15, 16, run_level(16, 2)}, {0x1f, 16, run_level(27, 1)},
+  {0x1e, 16, run_level(28, 1)}, {0x1d, 16, run_level(29, 1)}, {0x1c, 16, run_level(30, 1)}, {0x1b, 16, run_level(31, 1)}
+};
+
+struct vlc_tables {
+  vlc_table macroblock_address_increment{macroblock_address_increment_codes};
+  vlc_table macroblock_type_i{macroblock_type_i_codes};
+  vlc_table macroblock_type_p{macroblock_type_p_codes};
+  vlc_table macroblock_type_b{macroblock_type_b_codes};
+  vlc_table coded_block_pattern{coded_block_pattern_codes};
+  vlc_table motion_code{motion_code_codes};
+  vlc_table dct_dc_size_luminance{dct_dc_size_luminance_codes};
+  vlc_table dct_dc_size_chrominance{dct_dc_size_chrominance_codes};
+  vlc_table dct_coefficients_zero{dct_coefficients_zero_codes};
+  vlc_table dct_coefficients_one{dct_coefficients_one_codes};
+};
+
+inline vlc_tables const& tables() {
+  static const vlc_tables t;
+  return t;
+}
+
+constexpr std::uint8_t scan[2][64] = {
+  { 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+   12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+   35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+   58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63},
+  { 0,  8, 16, 24,  1,  9,  2, 10, 17, 25, 32, 40, 48, 56, 57, 49,
+   41, 33, 26, 18,  3, 11,  4, 12, 19, 27, 34, 42, 50, 58, 35, 43,
+   51, 59, 20, 28,  5, 13,  6, 14, 21, 29, 36, 44, 52, 60, 37, 45,
+   53, 61, 22, 30,  7, 15, 23, 31, 38, 46, 54, 62, 39, 47, 55, 63}
+};
+
+constexpr std::uint8_t non_linear_quantiser_scale[32] = {
+   0,  1,  2,  3,  4,  5,  6,  7,  8, 10, 12, 14, 16, 18, 20, 22,
+  24, 28, 32, 36, 40, 44, 48, 52, 56, 64, 72, 80, 88, 96, 104, 112
+};
+
+// 8x8 inverse dct after the islow algorithm of the IJG library on 8 lanes at a time: the
+// first pass transforms all columns with rows as vectors, the second one the transposed block
+typedef std::int32_t v8si __attribute__((vector_size(32)));
+
+inline void idct_1d(v8si* v, int shift) {
+  const std::int32_t fix_0_298631336 = 2446, fix_0_390180644 = 3196, fix_0_541196100 = 4433, fix_0_765366865 = 6270,
+    fix_0_899976223 = 7373, fix_1_175875602 = 9633, fix_1_501321110 = 12299, fix_1_847759065 = 15137,
+    fix_1_961570560 = 16069, fix_2_053119869 = 16819, fix_2_562915447 = 20995, fix_3_072711026 = 25172;
+
+  v8si z1 = (v[2] + v[6]) * fix_0_541196100;
+  v8si tmp2 = z1 + v[6] * -fix_1_847759065;
+  v8si tmp3 = z1 + v[2] * fix_0_765366865;
+  v8si tmp0 = (v[0] + v[4]) << 13;
+  v8si tmp1 = (v[0] - v[4]) << 13;
+
+  v8si tmp10 = tmp0 + tmp3;
+  v8si tmp13 = tmp0 - tmp3;
+  v8si tmp11 = tmp1 + tmp2;
+  v8si tmp12 = tmp1 - tmp2;
+
+  tmp0 = v[7];
+  tmp1 = v[5];
+  tmp2 = v[3];
+  tmp3 = v[1];
+
+  z1 = tmp0 + tmp3;
+  v8si z2 = tmp1 + tmp2;
+  v8si z3 = tmp0 + tmp2;
+  v8si z4 = tmp1 + tmp3;
+  v8si z5 = (z3 + z4) * fix_1_175875602;
+
+  tmp0 *= fix_0_298631336;
+  tmp1 *= fix_2_053119869;
+  tmp2 *= fix_3_072711026;
+  tmp3 *= fix_1_501321110;
+  z1 *= -fix_0_899976223;
+  z2 *= -fix_2_562915447;
+  z3 = z3 * -fix_1_961570560 + z5;
+  z4 = z4 * -fix_0_390180644 + z5;
+
+  tmp0 += z1 + z3;
+  tmp1 += z2 + z4;
+  tmp2 += z2 + z3;
+  tmp3 += z1 + z4;
+
+  v8si round = v8si{} + (1 << (shift - 1));
+  v[0] = (tmp10 + tmp3 + round) >> shift;
+  v[7] = (tmp10 - tmp3 + round) >> shift;
+  v[1] = (tmp11 + tmp2 + round) >> shift;
+  v[6] = (tmp11 - tmp2 + round) >> shift;
+  v[2] = (tmp12 + tmp1 + round) >> shift;
+  v[5] = (tmp12 - tmp1 + round) >> shift;
+  v[3] = (tmp13 + tmp0 + round) >> shift;
+  v[4] = (tmp13 - tmp0 + round) >> shift;
+}
+
+inline void transpose(std::int32_t* b) {
+  for(int i = 0; i != 8; ++i)
+    for(int j = i + 1; j != 8; ++j)
+      std::swap(b[i * 8 + j], b[j * 8 + i]);
+}
+
+// in place on a raster order block, the result is saturated to [-256, 255]
+inline void idct(std::int32_t* block) {
+  v8si v[8];
+  std::memcpy(v, block, sizeof(v));
+  idct_1d(v, 11);
+  std::memcpy(block, v, sizeof(v));
+
+  transpose(block);
+
+  std::memcpy(v, block, sizeof(v));
+  idct_1d(v, 18);
+  std::memcpy(block, v, sizeof(v));
+
+  transpose(block);
+
+  for(int i = 0; i != 64; ++i)
+    block[i] = std::min(std::max(block[i], -256), 255);
+}
+
+// half sample interpolation on 8 or 16 pixel rows, exact for the rounding of 7.6.4
+template<int W>
+struct pixels {
+  typedef std::uint8_t type __attribute__((vector_size(W)));
+
+  static type load(std::uint8_t const* p) { type v; std::memcpy(&v, p, W); return v; }
+  static void store(std::uint8_t* p, type v) { std::memcpy(p, &v, W); }
+
+  static type avg2(type a, type b) { return (a | b) - ((a ^ b) >> 1); }
+
+  static type avg4(type a, type b, type c, type d) {
+    return (a >> 2) + (b >> 2) + (c >> 2) + (d >> 2) + (((a & 3) + (b & 3) + (c & 3) + (d & 3) + 2) >> 2);
+  }
+};
+
+// forms w x h prediction samples from a window of (w + 1) x (h + 1) samples, averaging with dst
+// for the second prediction of bidirectional and dual prime macroblocks
+template<int W>
+void predict(std::uint8_t const* src, int src_stride, bool hx, bool hy, int h, std::uint8_t* dst, int dst_stride, bool average) {
+  using p = pixels<W>;
+
+  for(int y = 0; y != h; ++y, src += src_stride, dst += dst_stride) {
+    typename p::type v;
+    if(!hx && !hy) v = p::load(src);
+    else if(!hy) v = p::avg2(p::load(src), p::load(src + 1));
+    else if(!hx) v = p::avg2(p::load(src), p::load(src + src_stride));
+    else v = p::avg4(p::load(src), p::load(src + 1), p::load(src + src_stride), p::load(src + src_stride + 1));
+
+    p::store(dst, average ? p::avg2(p::load(dst), v) : v);
+  }
+}
+
+struct frame {
+  std::uint8_t* luma = nullptr;
+  std::uint8_t* chroma = nullptr;
+  std::uint32_t stride = 0; // tiles per row
+
+  explicit operator bool() const { return luma; }
+
+  std::uint8_t* luma_at(int x, int y) const {
+    return luma + ((y >> 4) * stride + (x >> 4)) * 256 + (y & 15) * 16 + (x & 15);
+  }
+
+  // x in chroma samples, Cb at the returned address and Cr right after it
+  std::uint8_t* chroma_at(int x, int y) const {
+    return chroma + ((y >> 3) * stride + (x >> 3)) * 128 + (y & 7) * 16 + (x & 7) * 2;
+  }
+};
+
+template<typename Buffer>
+frame make_frame(Buffer const& b) {
+  frame f;
+  if(b) {
+    f.luma = static_cast<std::uint8_t*>(luma_buffer(b));
+    f.chroma = static_cast<std::uint8_t*>(chroma_buffer(b));
+    f.stride = buffer_traits<Buffer>::width / 16;
+  }
+  return f;
+}
+
+struct picture {
+  int mb_width;
+  int mb_height;      // in macroblock rows of the picture, field rows for field pictures
+  int width;
+  int height;         // in frame rows
+
+  bool mpeg2;
+  int coding;         // 1 I, 2 P, 3 B
+  int structure;      // 1 top field, 2 bottom field, 3 frame
+  bool second_field;
+
+  unsigned f_code[2][2];
+  bool full_pel[2];
+  unsigned intra_dc_precision;
+  bool frame_pred_frame_dct;
+  bool concealment_motion_vectors;
+  bool q_scale_type;
+  bool intra_vlc_format;
+  bool alternate_scan;
+  bool top_field_first;
+
+  std::uint8_t intra_quantiser_matrix[64];
+  std::uint8_t non_intra_quantiser_matrix[64];
+
+  frame current;
+  frame forward;
+  frame backward;
+
+  bool field_picture() const { return structure != 3; }
+  int parity() const { return structure - 1; }
+};
+
+struct macroblock {
+  std::uint8_t y[16 * 16];
+  std::uint8_t cb[8 * 8];
+  std::uint8_t cr[8 * 8];
+};
+
+// copies a window of the frame (parity < 0) or of one of its fields into a raster buffer,
+// clamping coordinates to the picture
+inline void fetch_luma(picture const& pic, frame const& f, int parity, int x, int y, int w, int h, std::uint8_t* dst, int dst_stride) {
+  int rows = parity < 0 ? pic.height : pic.height / 2;
+
+  for(int r = 0; r != h; ++r, dst += dst_stride) {
+    int fy = std::min(std::max(y + r, 0), rows - 1);
+    if(parity >= 0) fy = fy * 2 + parity;
+
+    if(x >= 0 && x + w <= pic.width) {
+      for(int c = 0; c != w;) {
+        int n = std::min(w - c, 16 - ((x + c) & 15));
+        std::memcpy(dst + c, f.luma_at(x + c, fy), n);
+        c += n;
+      }
+    }
+    else {
+      for(int c = 0; c != w; ++c)
+        dst[c] = *f.luma_at(std::min(std::max(x + c, 0), pic.width - 1), fy);
+    }
+  }
+}
+
+inline void fetch_chroma(picture const& pic, frame const& f, int parity, int x, int y, int w, int h, std::uint8_t* cb, std::uint8_t* cr, int dst_stride) {
+  int rows = (parity < 0 ? pic.height : pic.height / 2) / 2;
+  int cols = pic.width / 2;
+
+  for(int r = 0; r != h; ++r, cb += dst_stride, cr += dst_stride) {
+    int fy = std::min(std::max(y + r, 0), rows - 1);
+    if(parity >= 0) fy = fy * 2 + parity;
+
+    for(int c = 0; c != w; ++c) {
+      auto p = f.chroma_at(std::min(std::max(x + c, 0), cols - 1), fy);
+      cb[c] = p[0];
+      cr[c] = p[1];
+    }
+  }
+}
+
+// predicts h luma rows of the macroblock from the reference (a field of it for parity >= 0)
+// at (x, y) displaced by the vector in half samples, writing macroblock rows first, first +
+// step and so on
+inline void motion_compensate(picture const& pic, frame const& ref, int parity, int x, int y, int mvx, int mvy,
+  int h, int first, int step, bool average, macroblock& mb)
+{
+  std::uint8_t window[17 * 17];
+  std::uint8_t cb[9 * 9];
+  std::uint8_t cr[9 * 9];
+
+  if(!ref) {
+    for(int r = 0; r != h; ++r) std::memset(mb.y + (first + r * step) * 16, 128, 16);
+    int cfirst = step == 1 ? first / 2 : first;
+    for(int r = 0; r != h / 2; ++r) {
+      std::memset(mb.cb + (cfirst + r * step) * 8, 128, 8);
+      std::memset(mb.cr + (cfirst + r * step) * 8, 128, 8);
+    }
+    return;
+  }
+
+  fetch_luma(pic, ref, parity, x + (mvx >> 1), y + (mvy >> 1), 17, h + 1, window, 17);
+  predict<16>(window, 17, mvx & 1, mvy & 1, h, mb.y + first * 16, step * 16, average);
+
+  int cmvx = mvx / 2;
+  int cmvy = mvy / 2;
+  int cfirst = step == 1 ? first / 2 : first;
+
+  fetch_chroma(pic, ref, parity, x / 2 + (cmvx >> 1), y / 2 + (cmvy >> 1), 9, h / 2 + 1, cb, cr, 9);
+  predict<8>(cb, 9, cmvx & 1, cmvy & 1, h / 2, mb.cb + cfirst * 8, step * 8, average);
+  predict<8>(cr, 9, cmvx & 1, cmvy & 1, h / 2, mb.cr + cfirst * 8, step * 8, average);
+}
+
+inline void store(picture const& pic, int mbx, int mby, macroblock const& mb) {
+  if(!pic.field_picture()) {
+    std::memcpy(pic.current.luma_at(mbx * 16, mby * 16), mb.y, sizeof(mb.y));
+    auto c = pic.current.chroma_at(mbx * 8, mby * 8);
+    for(int i = 0; i != 64; ++i) {
+      c[i * 2] = mb.cb[i];
+      c[i * 2 + 1] = mb.cr[i];
+    }
+  }
+  else {
+    for(int r = 0; r != 16; ++r)
+      std::memcpy(pic.current.luma_at(mbx * 16, (mby * 16 + r) * 2 + pic.parity()), mb.y + r * 16, 16);
+
+    for(int r = 0; r != 8; ++r) {
+      auto c = pic.current.chroma_at(mbx * 8, (mby * 8 + r) * 2 + pic.parity());
+      for(int i = 0; i != 8; ++i) {
+        c[i * 2] = mb.cb[r * 8 + i];
+        c[i * 2 + 1] = mb.cr[r * 8 + i];
+      }
+    }
+  }
+}
+
+enum motion_type { motion_field = 1, motion_frame = 2, motion_16x8 = 2, motion_dual_prime = 3 };
+
+struct motion {
+  int flags = 0;                   // macroblock_motion_forward and backward
+  int type = motion_frame;         // frame_motion_type or field_motion_type
+  int vector[2][2][2] = {};        // [r][s][t] in half samples, vertical in field units for field vectors
+  int field_select[2][2] = {};     // [r][s]
+  int dmvector[2] = {};
+};
+
+template<typename I>
+class slice_decoder {
+  picture const& pic;
+  bitstream::bit_parser<I> bits;
+  vlc_tables const& t = tables();
+
+  int quantiser_scale;
+  int dc_pred[3];
+  int pmv[2][2][2];
+  motion last;
+
+  void reset_dc_pred() {
+    dc_pred[0] = dc_pred[1] = dc_pred[2] = 1 << (7 + pic.intra_dc_precision);
+  }
+
+  void reset_pmv() {
+    std::memset(pmv, 0, sizeof(pmv));
+  }
+
+  void set_quantiser_scale(unsigned code) {
+    quantiser_scale = pic.q_scale_type ? non_linear_quantiser_scale[code] : code * 2;
+  }
+
+  int decode_motion_vector(int r, int s, int t, bool field_vector) {
+    int f_code = pic.f_code[s][t];
+    int r_size = f_code - 1;
+
+    int code = read_vlc(bits, this->t.motion_code);
+    if(code && u(bits, 1)) code = -code;
+
+    int delta = code;
+    if(f_code != 1 && code) {
+      int residual = u(bits, r_size);
+      delta = ((std::abs(code) - 1) << r_size) + residual + 1;
+      if(code < 0) delta = -delta;
+    }
+
+    bool scaled = field_vector && t == 1 && !pic.field_picture();
+    int prediction = scaled ? pmv[r][s][t] >> 1 : pmv[r][s][t];
+
+    int f = 1 << r_size;
+    int v = prediction + delta;
+    if(v < -16 * f) v += 32 * f;
+    if(v > 16 * f - 1) v -= 32 * f;
+
+    pmv[r][s][t] = scaled ? v * 2 : v;
+    return v;
+  }
+
+  int decode_dmvector() {
+    if(!u(bits, 1)) return 0;
+    return u(bits, 1) ? -1 : 1;
+  }
+
+  void decode_motion_vectors(int s, motion& m, int count, bool field_format, bool dmv) {
+    for(int r = 0; r != count; ++r) {
+      if(field_format && !dmv) m.field_select[r][s] = u(bits, 1);
+      m.vector[r][s][0] = decode_motion_vector(r, s, 0, field_format);
+      if(dmv) m.dmvector[0] = decode_dmvector();
+      m.vector[r][s][1] = decode_motion_vector(r, s, 1, field_format);
+      if(dmv) m.dmvector[1] = decode_dmvector();
+    }
+
+    if(count == 1) {
+      pmv[1][s][0] = pmv[0][s][0];
+      pmv[1][s][1] = pmv[0][s][1];
+    }
+
+    if(!pic.mpeg2 && pic.full_pel[s]) {
+      m.vector[0][s][0] *= 2;
+      m.vector[0][s][1] *= 2;
+    }
+  }
+
+  frame const& reference(int s, int field_select) const {
+    if(s == 0 && pic.coding == 2 && pic.field_picture() && pic.second_field && field_select != pic.parity())
+      return pic.current;
+    return s == 0 ? pic.forward : pic.backward;
+  }
+
+  void predict_macroblock(int mbx, int mby, motion const& m, macroblock& mb) {
+    bool average = false;
+
+    for(int s = 0; s != 2; ++s) {
+      if(!(m.flags & (s ? macroblock_motion_backward : macroblock_motion_forward))) continue;
+
+      frame const& ref = s ? pic.backward : pic.forward;
+      auto const& v = m.vector;
+
+      if(!pic.field_picture()) {
+        if(m.type == motion_frame)
+          motion_compensate(pic, ref, -1, mbx * 16, mby * 16, v[0][s][0], v[0][s][1], 16, 0, 1, average, mb);
+        else if(m.type == motion_field) {
+          motion_compensate(pic, ref, m.field_select[0][s], mbx * 16, mby * 8, v[0][s][0], v[0][s][1], 8, 0, 2, average, mb);
+          motion_compensate(pic, ref, m.field_select[1][s], mbx * 16, mby * 8, v[1][s][0], v[1][s][1], 8, 1, 2, average, mb);
+        }
+        else {
+          int mx = v[0][s][0];
+          int my = v[0][s][1];
+          int k = pic.top_field_first ? 1 : 3;
+
+          motion_compensate(pic, ref, 0, mbx * 16, mby * 8, mx, my, 8, 0, 2, false, mb);
+          motion_compensate(pic, ref, 1, mbx * 16, mby * 8, mx, my, 8, 1, 2, false, mb);
+          motion_compensate(pic, ref, 1, mbx * 16, mby * 8,
+            ((mx * k + (mx > 0)) >> 1) + m.dmvector[0], ((my * k + (my > 0)) >> 1) + m.dmvector[1] - 1, 8, 0, 2, true, mb);
+          motion_compensate(pic, ref, 0, mbx * 16, mby * 8,
+            ((mx * (4 - k) + (mx > 0)) >> 1) + m.dmvector[0], ((my * (4 - k) + (my > 0)) >> 1) + m.dmvector[1] + 1, 8, 1, 2, true, mb);
+        }
+      }
+      else {
+        if(m.type == motion_field)
+          motion_compensate(pic, reference(s, m.field_select[0][s]), m.field_select[0][s], mbx * 16, mby * 16,
+            v[0][s][0], v[0][s][1], 16, 0, 1, average, mb);
+        else if(m.type == motion_16x8) {
+          motion_compensate(pic, reference(s, m.field_select[0][s]), m.field_select[0][s], mbx * 16, mby * 16,
+            v[0][s][0], v[0][s][1], 8, 0, 1, average, mb);
+          motion_compensate(pic, reference(s, m.field_select[1][s]), m.field_select[1][s], mbx * 16, mby * 16 + 8,
+            v[1][s][0], v[1][s][1], 8, 8, 1, average, mb);
+        }
+        else {
+          int mx = v[0][s][0];
+          int my = v[0][s][1];
+          int opposite = 1 - pic.parity();
+
+          motion_compensate(pic, reference(s, pic.parity()), pic.parity(), mbx * 16, mby * 16, mx, my, 16, 0, 1, false, mb);
+          motion_compensate(pic, reference(s, opposite), opposite, mbx * 16, mby * 16,
+            ((mx + (mx > 0)) >> 1) + m.dmvector[0], ((my + (my > 0)) >> 1) + m.dmvector[1] + (pic.parity() ? 1 : -1),
+            16, 0, 1, true, mb);
+        }
+      }
+
+      average = true;
+    }
+  }
+
+  int decode_escape_level() {
+    if(pic.mpeg2) {
+      int level = u(bits, 12);
+      return level & 0x800 ? level - 4096 : level;
+    }
+
+    int level = u(bits, 8);
+    if(level == 0) return u(bits, 8);
+    if(level == 128) return int(u(bits, 8)) - 256;
+    return level & 0x80 ? level - 256 : level;
+  }
+
+  int dequantise(int level, std::uint8_t w, bool intra) {
+    int k = intra ? 0 : (level > 0 ? 1 : -1);
+    int v = ((2 * level + k) * w * quantiser_scale) / 32;
+
+    if(!pic.mpeg2 && !(v & 1) && v) v -= v > 0 ? 1 : -1;
+    return std::min(std::max(v, -2048), 2047);
+  }
+
+  // reads one block into block[] in raster order, dequantised and ready for the idct
+  void decode_block(int b, bool intra, std::int32_t* block) {
+    std::memset(block, 0, 64 * sizeof(*block));
+
+    auto const& scan_table = scan[pic.alternate_scan];
+    auto const* w = intra ? pic.intra_quantiser_matrix : pic.non_intra_quantiser_matrix;
+    auto const& table = intra && pic.intra_vlc_format ? t.dct_coefficients_one : t.dct_coefficients_zero;
+
+    int n = 0;
+    int sum = 0;
+
+    if(intra) {
+      int cc = b < 4 ? 0 : b - 3;
+      int size = read_vlc(bits, cc ? t.dct_dc_size_chrominance : t.dct_dc_size_luminance);
+      int diff = 0;
+      if(size) {
+        diff = u(bits, size);
+        if(diff < (1 << (size - 1))) diff += 1 - (1 << size);
+      }
+
+      dc_pred[cc] += diff;
+      block[0] = dc_pred[cc] << (3 - pic.intra_dc_precision);
+      sum = block[0];
+      n = 1;
+    }
+    else if(next_bits(bits, 1)) {
+      u(bits, 1);
+      block[0] = dequantise(u(bits, 1) ? -1 : 1, w[0], false);
+      sum = block[0];
+      n = 1;
+    }
+
+    for(;;) {
+      int v = read_vlc(bits, table);
+      if(v == vlc_eob) break;
+
+      int run, level;
+      if(v == vlc_escape) {
+        run = u(bits, 6);
+        level = decode_escape_level();
+        if(!level) throw mpeg::parse_error();
+      }
+      else {
+        run = v >> 8;
+        level = u(bits, 1) ? -(v & 0xff) : (v & 0xff);
+      }
+
+      n += run;
+      if(n >= 64) throw mpeg::parse_error();
+
+      int i = scan_table[n++];
+      block[i] = dequantise(level, w[i], intra);
+      sum += block[i];
+    }
+
+    if(pic.mpeg2 && !(sum & 1)) block[63] ^= 1;
+  }
+
+  void add_block(std::int32_t const* block, std::uint8_t* dst, int stride, bool intra) {
+    for(int y = 0; y != 8; ++y, dst += stride, block += 8)
+      for(int x = 0; x != 8; ++x)
+        dst[x] = std::min(std::max((intra ? 0 : dst[x]) + block[x], 0), 255);
+  }
+
+  void decode_macroblock(int mbx, int mby) {
+    int type = read_vlc(bits, pic.coding == 1 ? t.macroblock_type_i : (pic.coding == 2 ? t.macroblock_type_p : t.macroblock_type_b));
+    bool intra = type & macroblock_intra;
+    int motion_flags = type & (macroblock_motion_forward | macroblock_motion_backward);
+
+    motion m;
+    m.flags = motion_flags;
+    m.type = pic.field_picture() ? motion_field : motion_frame;
+
+    if(pic.mpeg2 && motion_flags) {
+      if(pic.field_picture() || !pic.frame_pred_frame_dct)
+        m.type = u(bits, 2);
+    }
+
+    bool dct_field = !pic.field_picture() && !pic.frame_pred_frame_dct && (intra || (type & macroblock_pattern)) && u(bits, 1);
+
+    if(type & macroblock_quant) set_quantiser_scale(u(bits, 5));
+
+    int count = 1;
+    bool field_format = pic.field_picture();
+    bool dmv = m.type == motion_dual_prime;
+
+    if(!pic.field_picture()) {
+      count = m.type == motion_field ? 2 : 1;
+      field_format = m.type != motion_frame;
+    }
+    else
+      count = m.type == motion_16x8 ? 2 : 1;
+
+    bool concealment = intra && pic.concealment_motion_vectors;
+
+    if((motion_flags & macroblock_motion_forward) || concealment)
+      decode_motion_vectors(0, m, count, field_format, dmv);
+    if(motion_flags & macroblock_motion_backward)
+      decode_motion_vectors(1, m, count, field_format, dmv);
+    if(concealment) u(bits, 1);
+
+    int cbp = 0;
+    if(type & macroblock_pattern) cbp = read_vlc(bits, t.coded_block_pattern);
+    if(intra) cbp = 63;
+
+    macroblock mb;
+
+    if(intra) {
+      if(!concealment) reset_pmv();
+    }
+    else {
+      reset_dc_pred();
+
+      if(pic.coding == 2 && !(motion_flags & macroblock_motion_forward)) {
+        reset_pmv();
+        m = motion();
+        m.flags = macroblock_motion_forward;
+        m.type = pic.field_picture() ? motion_field : motion_frame;
+        m.field_select[0][0] = pic.field_picture() ? pic.parity() : 0;
+      }
+
+      predict_macroblock(mbx, mby, m, mb);
+      last = m;
+    }
+
+    std::int32_t block[64];
+    for(int b = 0; b != 6; ++b) {
+      if(!(cbp & (32 >> b))) continue;
+
+      decode_block(b, intra, block);
+      idct(block);
+
+      if(b < 4) {
+        auto dst = dct_field ? mb.y + (b >> 1) * 16 + (b & 1) * 8 : mb.y + (b >> 1) * 8 * 16 + (b & 1) * 8;
+        add_block(block, dst, dct_field ? 32 : 16, intra);
+      }
+      else
+        add_block(block, b == 4 ? mb.cb : mb.cr, 8, intra);
+    }
+
+    store(pic, mbx, mby, mb);
+  }
+
+  void skip_macroblock(int mbx, int mby) {
+    reset_dc_pred();
+
+    if(pic.coding == 2) {
+      reset_pmv();
+      last = motion();
+      last.flags = macroblock_motion_forward;
+      last.type = pic.field_picture() ? motion_field : motion_frame;
+      last.field_select[0][0] = pic.field_picture() ? pic.parity() : 0;
+    }
+
+    macroblock mb;
+    predict_macroblock(mbx, mby, last, mb);
+    store(pic, mbx, mby, mb);
+  }
+
+public:
+  slice_decoder(picture const& pic, I first, I last) :
+    pic(pic), bits(bitstream::make_bit_parser(bitstream::make_bit_range(utils::make_range(first, last)))) {}
+
+  // decodes the slice following a slice start code, returns the number of macroblocks written
+  std::size_t operator()() {
+    std::size_t decoded = 0;
+
+    try {
+      int row = u(bits, 8) - 1;
+      set_quantiser_scale(u(bits, 5));
+      if(pic.mpeg2 && next_bits(bits, 1)) u(bits, 9);
+      while(u(bits, 1)) u(bits, 8);
+
+      reset_dc_pred();
+      reset_pmv();
+
+      int address = row * pic.mb_width - 1;
+      bool first = true;
+
+      for(;;) {
+        int increment = 0;
+        for(;;) {
+          int v = read_vlc(bits, t.macroblock_address_increment);
+          if(v == vlc_stuffing) continue;
+          if(v == vlc_escape) { increment += 33; continue; }
+          increment += v;
+          break;
+        }
+
+        if(address + increment >= pic.mb_width * pic.mb_height) throw mpeg::parse_error();
+
+        if(!first) {
+          for(int i = 1; i < increment; ++i, ++decoded)
+            skip_macroblock((address + i) % pic.mb_width, (address + i) / pic.mb_width);
+        }
+
+        address += increment;
+        first = false;
+
+        decode_macroblock(address % pic.mb_width, address / pic.mb_width);
+        ++decoded;
+
+        if(next_bits(bits, 23) == 0) break;
+      }
+    }
+    catch(mpeg::parse_error const&) {
+    }
+
+    return decoded;
+  }
+};
+
+template<typename Buffer, typename Sequence>
+picture make_picture(msvd::detail::mpeg_context<Buffer, Sequence> const& cx) {
+  auto const& p = cx.params;
+  picture pic;
+
+  pic.mpeg2 = p.mpeg2;
+  pic.coding = p.picture_coding_type == msvd_coding_type_I ? 1 : (p.picture_coding_type == msvd_coding_type_P ? 2 : 3);
+  pic.structure = 3;
+  pic.second_field = false;
+
+  if(p.mpeg2) {
+    pic.structure = p.picture_structure == msvd_picture_type_top ? 1 : (p.picture_structure == msvd_picture_type_bot ? 2 : 3);
+    for(int s = 0; s != 2; ++s)
+      for(int t = 0; t != 2; ++t)
+        pic.f_code[s][t] = p.f_code[s][t];
+    pic.full_pel[0] = pic.full_pel[1] = false;
+    pic.intra_dc_precision = p.intra_dc_precision;
+    pic.frame_pred_frame_dct = p.frame_pred_frame_dct;
+    pic.concealment_motion_vectors = p.concealment_motion_vectors;
+    pic.q_scale_type = p.q_scale_type;
+    pic.intra_vlc_format = p.intra_vlc_format;
+    pic.alternate_scan = p.alternate_scan;
+    pic.top_field_first = p.top_field_first;
+  }
+  else {
+    pic.f_code[0][0] = pic.f_code[0][1] = p.forward_f_code;
+    pic.f_code[1][0] = pic.f_code[1][1] = p.backward_f_code;
+    pic.full_pel[0] = p.full_pel_forward_vector;
+    pic.full_pel[1] = p.full_pel_backward_vector;
+    pic.intra_dc_precision = 0;
+    pic.frame_pred_frame_dct = true;
+    pic.concealment_motion_vectors = false;
+    pic.q_scale_type = false;
+    pic.intra_vlc_format = false;
+    pic.alternate_scan = false;
+    pic.top_field_first = false;
+  }
+
+  // the driver gets the sizes truncated to whole macroblocks, the coded picture covers whole
+  // macroblock rows of both fields
+  pic.mb_width = p.hor_pic_size_in_mbs;
+  pic.width = pic.mb_width * 16;
+  pic.height = std::min<int>((p.ver_pic_size_in_mbs * 16 + 31) / 32 * 32, buffer_traits<Buffer>::height);
+  pic.mb_height = pic.field_picture() ? pic.height / 32 : pic.height / 16;
+
+  // quantiser matrices are passed in the zigzag order of the bitstream
+  if(p.intra_quantiser_matrix)
+    for(int i = 0; i != 64; ++i) pic.intra_quantiser_matrix[scan[0][i]] = p.intra_quantiser_matrix->data[i];
+  else
+    std::copy(mpeg::default_intra_quantiser_matrix.begin(), mpeg::default_intra_quantiser_matrix.end(), pic.intra_quantiser_matrix);
+
+  if(p.non_intra_quantiser_matrix)
+    for(int i = 0; i != 64; ++i) pic.non_intra_quantiser_matrix[scan[0][i]] = p.non_intra_quantiser_matrix->data[i];
+  else
+    std::copy(mpeg::default_non_intra_quantiser_matrix.begin(), mpeg::default_non_intra_quantiser_matrix.end(), pic.non_intra_quantiser_matrix);
+
+  pic.current = make_frame(cx.curr);
+
+  // refs[0] is the most recently decoded reference, the backward one for B pictures
+  if(pic.coding == 2) pic.forward = make_frame(cx.refs[0]);
+  if(pic.coding == 3) {
+    pic.forward = make_frame(cx.refs[1]);
+    pic.backward = make_frame(cx.refs[0]);
+  }
+
+  return pic;
+}
+
+// the coded picture is gathered into one buffer and split at slice start codes
+struct slice {
+  std::uint8_t const* first;
+  std::uint8_t const* last;
+};
+
+template<typename Sequence>
+std::vector<slice> find_slices(Sequence const& buffers, std::vector<std::uint8_t>& data) {
+  data.clear();
+  for(auto const& b: buffers) {
+    auto p = static_cast<std::uint8_t const*>(b.iov_base);
+    data.insert(data.end(), p, p + b.iov_len);
+  }
+
+  std::vector<slice> slices;
+  auto end = data.data() + data.size();
+  auto i = bitstream::find_startcode_prefix(data.data(), end);
+
+  while(i != end) {
+    auto next = bitstream::find_startcode_prefix(i + 3, end);
+    if(i + 3 != end && i[3] >= mpeg::slice_start_code_begin && i[3] < mpeg::slice_start_code_end)
+      slices.push_back(slice{i + 3, next});
+    i = next;
+  }
+
+  return slices;
+}
+
+#ifndef ASIO_DISABLE_THREADS
+class worker_pool {
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable start;
+  std::condition_variable done;
+
+  std::function<void(std::size_t)> const* task = nullptr;
+  std::size_t count = 0;
+  std::atomic<std::size_t> next{0};
+  std::size_t generation = 0;
+  std::size_t active = 0;
+  bool stop = false;
+
+  void work() {
+    for(auto i = next++; i < count; i = next++)
+      (*task)(i);
+  }
+
+  void run() {
+    std::size_t seen = 0;
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> lock(m);
+        start.wait(lock, [&] { return stop || generation != seen; });
+        if(stop) return;
+        seen = generation;
+      }
+
+      work();
+
+      std::lock_guard<std::mutex> lock(m);
+      if(--active == 0) done.notify_one();
+    }
+  }
+
+public:
+  explicit worker_pool(unsigned n) {
+    for(unsigned i = 0; i != n; ++i)
+      threads.emplace_back([this] { run(); });
+  }
+
+  worker_pool(worker_pool const&) = delete;
+  worker_pool& operator=(worker_pool const&) = delete;
+
+  ~worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stop = true;
+    }
+    start.notify_all();
+    for(auto& t: threads) t.join();
+  }
+
+  // runs f(i) for every i in [0, n) on the pool and the calling thread, returns when all are done
+  void parallel_for(std::size_t n, std::function<void(std::size_t)> const& f) {
+    if(threads.empty() || n < 2) {
+      for(std::size_t i = 0; i != n; ++i) f(i);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m);
+      task = &f;
+      count = n;
+      next = 0;
+      active = threads.size();
+      ++generation;
+    }
+    start.notify_all();
+
+    work();
+
+    std::unique_lock<std::mutex> lock(m);
+    done.wait(lock, [&] { return active == 0; });
+    task = nullptr;
+  }
+};
+#endif
+
+} // namespace detail
+
+// Decodes pictures one at a time in submission order, so a picture may be submitted as soon
+// as its references have been. With asio threads enabled the slices of a picture are decoded
+// on a pool of worker threads and completions are posted to the io_service.
+class decoder {
+public:
+#ifndef ASIO_DISABLE_THREADS
+  decoder(asio::io_service& io, unsigned threads = std::thread::hardware_concurrency()) :
+    io(io), pool(threads > 1 ? threads - 1 : 0), sequencer([this] { run(); }) {}
+
+  ~decoder() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stop = true;
+    }
+    cv.notify_one();
+    sequencer.join();
+  }
+#else
+  decoder(asio::io_service& io, unsigned = 1) : io(io) {}
+#endif
+
+  decoder(decoder const&) = delete;
+  decoder& operator=(decoder const&) = delete;
+
+  asio::io_service& io;
+
+  template<typename B, typename S, typename F>
+  friend auto async_decode_picture(decoder& d, std::unique_ptr<msvd::detail::mpeg_context<B, S>> cx, F callback) ->
+    typename std::enable_if<utils::is_callable<F(std::error_code, msvd::decode_result)>::value>::type
+  {
+    auto mc = utils::move_on_copy(std::move(cx));
+    auto cb = utils::move_on_copy(std::move(callback));
+    auto work = std::make_shared<asio::io_service::work>(d.io);
+
+    d.submit([&d, mc, cb, work]() mutable {
+      auto n = d.decode(*unwrap(mc));
+      d.io.post([mc, cb, n]() mutable {
+        unwrap(cb)(std::error_code(), msvd::decode_result{n});
+      });
+    });
+  }
+
+private:
+  template<typename B, typename S>
+  std::size_t decode(msvd::detail::mpeg_context<B, S> const& cx) {
+    auto current = detail::make_frame(cx.curr);
+    auto pic = detail::make_picture(cx);
+
+    // the second field of a frame is decoded into the same buffer as the first one
+    pic.second_field = pic.field_picture() && current.luma && current.luma == last_field.luma && pic.structure != last_structure;
+
+    last_field = pic.field_picture() && !pic.second_field ? current : detail::frame();
+    last_structure = pic.structure;
+
+    if(!pic.current) return 0;
+
+    auto slices = detail::find_slices(cx.buffers, data);
+    std::vector<std::size_t> decoded(slices.size());
+
+    auto decode_slice = [&](std::size_t i) {
+      decoded[i] = detail::slice_decoder<std::uint8_t const*>(pic, slices[i].first, slices[i].last)();
+    };
+
+#ifndef ASIO_DISABLE_THREADS
+    pool.parallel_for(slices.size(), decode_slice);
+#else
+    for(std::size_t i = 0; i != slices.size(); ++i) decode_slice(i);
+#endif
+
+    std::size_t n = 0;
+    for(auto d: decoded) n += d;
+    return n;
+  }
+
+#ifndef ASIO_DISABLE_THREADS
+  void submit(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      jobs.push_back(std::move(job));
+    }
+    cv.notify_one();
+  }
+
+  void run() {
+    for(;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&] { return stop || !jobs.empty(); });
+        if(stop) return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+    }
+  }
+#else
+  void submit(std::function<void()> job) {
+    job();
+  }
+#endif
+
+  std::vector<std::uint8_t> data;
+  detail::frame last_field;
+  int last_structure = 3;
+
+#ifndef ASIO_DISABLE_THREADS
+  detail::worker_pool pool;
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> jobs;
+  bool stop = false;
+  std::thread sequencer;
+#endif
+};
+
+} // namespace software
+
+template<>
+struct executes_in_order<software::decoder> : std::true_type {};
+
+} // namespace msvd
+} // namespace media
+
+#endif
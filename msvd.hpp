@@ -11,6 +11,7 @@
 #include "utils.hpp"
 #include "utils/utils/asio_utils.hpp"
 #include <linux/msvdhd.h>
+#include <functional>
 #include "video.hpp"
 
 namespace media {
@@ -42,6 +43,199 @@ struct decoder {
   asio::posix::stream_descriptor fd;
 };
 
+// Backends confirmed to execute requests in submission order, so a request may be submitted
+// while earlier ones are still running. The msvd driver is not known to do so.
+template<typename Decoder>
+struct executes_in_order : std::false_type {};
+
+// Device interface used by slice_queue: a slice request is written with an ioctl and its result
+// is read back, results come in submission order. Only one result is read at a time, as the
+// driver is not known to return several completed results in one read.
+template<typename F>
+void async_submit(decoder& d, msvd_h264_decode_params const& params, F callback) {
+  d.fd.async_write_some(utils::make_ioctl_write_buffer<MSVD_DECODE_H264_SLICE>(std::ref(params)),
+    [cb = utils::move_on_copy(std::move(callback))](std::error_code const& ec, std::size_t) mutable {
+      cb(ec);
+    });
+}
+
+template<typename F>
+void async_reap(decoder& d, msvd_decode_result* results, std::size_t, F callback) {
+  d.fd.async_read_some(asio::mutable_buffers_1(results, sizeof(msvd_decode_result)),
+    [cb = utils::move_on_copy(std::move(callback))](std::error_code const& ec, std::size_t size) mutable {
+      cb(ec, size / sizeof(msvd_decode_result));
+    });
+}
+
+// Submits h264 slices to a Device, up to depth of them in flight, and reaps their results in
+// bulk when the device returns several per read. Depths over 1 are taken only by devices that
+// execute requests in order (executes_in_order), so the msvd device keeps one slice in flight
+// with a write and a read per slice. Entries live in a ring that only grows and keep callbacks
+// of up to inline_size bytes in place, so steady state submission does not allocate. The queue
+// must outlive the requests in it.
+template<typename Device>
+class slice_queue {
+public:
+  static constexpr std::size_t inline_size = 128;
+
+  explicit slice_queue(Device& device, std::size_t depth = 1) :
+    device(device), ring(16), results(executes_in_order<Device>::value ? std::max<std::size_t>(depth, 1) : 1) {}
+
+  slice_queue(slice_queue const&) = delete;
+  slice_queue& operator=(slice_queue const&) = delete;
+
+  ~slice_queue() {
+    for(auto i = head; i != tail; ++i)
+      if(at(i).op) at(i).op(at(i), nullptr, nullptr);
+  }
+
+  // pr and rs point to the request and the result and are kept until callback(ec) is called
+  template<typename Pr, typename Rs, typename F>
+  friend auto async_decode_slice(slice_queue& q, Pr pr, Rs rs, F callback) -> std::enable_if_t<
+    std::is_convertible<decltype(*pr), msvd_h264_decode_params>::value
+    && std::is_convertible<decltype(*rs), msvd_decode_result>::value
+    && utils::is_callable<F(std::error_code)>::value>
+  {
+    using request_type = request<Pr, Rs, F>;
+
+    if(q.tail - q.head == q.ring.size()) q.grow();
+
+    auto& e = q.at(q.tail++);
+    e.params = &*pr;
+    e.result = &*rs;
+    store(e, request_type{std::move(pr), std::move(rs), std::move(callback)},
+      std::integral_constant<bool, sizeof(request_type) <= inline_size && alignof(request_type) <= alignof(std::max_align_t)>());
+
+    q.write();
+  }
+
+  std::size_t in_flight() const { return issued - head; }
+  std::size_t queued() const { return tail - issued; }
+
+private:
+  template<typename Pr, typename Rs, typename F>
+  struct request {
+    Pr pr;
+    Rs rs;
+    F callback;
+  };
+
+  struct entry {
+    msvd_h264_decode_params const* params;
+    msvd_decode_result* result;
+    // moves the request into to, or completes it with *ec and empties the entry, or only
+    // destroys it without ec, null once the request is completed
+    void (*op)(entry& e, entry* to, std::error_code const* ec);
+    std::aligned_storage_t<inline_size, alignof(std::max_align_t)> storage;
+  };
+
+  template<typename R>
+  static void store(entry& e, R r, std::true_type) {
+    new(&e.storage) R(std::move(r));
+    e.op = [](entry& e, entry* to, std::error_code const* ec) {
+      auto p = reinterpret_cast<R*>(&e.storage);
+      if(to) {
+        new(&to->storage) R(std::move(*p));
+        p->~R();
+        return;
+      }
+
+      // the callback may queue more slices and move the ring, so it runs off the entry
+      R r(std::move(*p));
+      p->~R();
+      e.op = nullptr;
+      if(ec) r.callback(*ec);
+    };
+  }
+
+  template<typename R>
+  static void store(entry& e, R r, std::false_type) {
+    *reinterpret_cast<R**>(&e.storage) = new R(std::move(r));
+    e.op = [](entry& e, entry* to, std::error_code const* ec) {
+      auto p = *reinterpret_cast<R**>(&e.storage);
+      if(to) {
+        *reinterpret_cast<R**>(&to->storage) = p;
+        return;
+      }
+
+      std::unique_ptr<R> r(p);
+      e.op = nullptr;
+      if(ec) r->callback(*ec);
+    };
+  }
+
+  entry& at(std::size_t i) { return ring[i & (ring.size() - 1)]; }
+
+  void grow() {
+    std::vector<entry> r(ring.size() * 2);
+    for(auto i = head; i != tail; ++i) {
+      auto& from = at(i);
+      auto& to = r[i & (r.size() - 1)];
+      to.params = from.params;
+      to.result = from.result;
+      to.op = from.op;
+      if(from.op) from.op(from, &to, nullptr);
+    }
+    ring.swap(r);
+  }
+
+  // entries completed out of order by a failed write are passed over
+  void retire() {
+    while(head != written && !at(head).op) ++head;
+  }
+
+  // Entries [head, written) are on the device unless their write failed, [written, issued) are
+  // being written and [issued, tail) wait for room. Writes complete in the order they were issued.
+  void write() {
+    for(; issued != tail && in_flight() != results.size(); ++issued)
+      async_submit(device, *at(issued).params, [this](std::error_code const& ec) {
+        auto& e = at(written++);
+        if(ec) {
+          e.op(e, nullptr, &ec);
+          retire();
+          write();
+        }
+        else {
+          ++on_device;
+          read();
+        }
+      });
+  }
+
+  // results come in the order of the requests, all that are complete are taken at once
+  void read() {
+    if(reading || !on_device) return;
+
+    reading = true;
+    async_reap(device, results.data(), std::min(on_device, results.size()), [this](std::error_code const& ec, std::size_t n) {
+      reading = false;
+      if(ec) n = on_device;
+
+      for(std::size_t i = 0; i != n; ++i) {
+        retire();
+        auto& e = at(head++);
+        --on_device;
+        if(!ec) *e.result = results[i];
+        e.op(e, nullptr, &ec);
+      }
+      retire();
+
+      read();
+      write();
+    });
+  }
+
+  Device& device;
+  std::vector<entry> ring;
+  std::vector<msvd_decode_result> results;
+  std::size_t head = 0;
+  std::size_t written = 0;
+  std::size_t issued = 0;
+  std::size_t tail = 0;
+  std::size_t on_device = 0;
+  bool reading = false;
+};
+
 //mpeg decoding impl
 namespace detail {
 
@@ -73,6 +267,17 @@ struct mpeg_context {
     Buffer curpic,
     Buffer ref0,
     Buffer ref1,
+    Sequence const& coded_picture_data) : mpeg_context(sh, ph, pcx, qmx, coded_picture_data)
+  {
+    bind(std::move(curpic), std::move(ref0), std::move(ref1));
+  }
+
+  // prepares everything but the frame buffers, which are set with bind()
+  mpeg_context(
+    mpeg::sequence_header_t const& sh,
+    mpeg::picture_header_t const& ph,
+    mpeg::picture_coding_extension_t const* pcx,
+    mpeg::quant_matrix_extension_t const* qmx,
     Sequence const& coded_picture_data)
   {
     using namespace mpeg;
@@ -128,8 +333,14 @@ struct mpeg_context {
     if(qmx && qmx->load_intra_quantiser_matrix) set_intra_quantiser_matrix(qmx->intra_quantiser_matrix);
     if(qmx && qmx->load_non_intra_quantiser_matrix) set_non_intra_quantiser_matrix(qmx->non_intra_quantiser_matrix);
 
+    buffers = bitstream::adapt_sequence(coded_picture_data);
+    params.slice_data = &*buffers.begin();
+    params.slice_data_n = buffers.size();
+  }
+
+  void bind(Buffer curpic, Buffer ref0, Buffer ref1) {
     params.curr_pic = phys_addr(curpic);
-    curpic = curpic;
+    curr = curpic;
 
     if(params.picture_coding_type == msvd_coding_type_P) {
       refs[0] = ref0;
@@ -144,10 +355,6 @@ struct mpeg_context {
       params.refpic1 = ref0 ? phys_addr(ref0) : 0;
       params.refpic2 = ref1 ? phys_addr(ref1) : 0;
     }
-
-    buffers = bitstream::adapt_sequence(coded_picture_data);
-    params.slice_data = &*buffers.begin();
-    params.slice_data_n = buffers.size();
   }
 
   mpeg_context(mpeg_context const&) = delete;
@@ -223,8 +430,48 @@ msvd_coding_type to_msvd(h264::coding_type p) {
   }
 }
 
+// the fields of a slice decoding request that depend only on the sps/pps pair and the frame
+// buffer layout, prepared once per parameter set change and copied into every slice
+template<typename FrameBuffer>
+msvd_h264_decode_params make_h264_parameters(h264::seq_parameter_set const& sps, h264::pic_parameter_set const& pps) {
+  msvd_h264_decode_params p;
+  memset(&p, 0, sizeof(p));
+
+  p.geometry = {
+    buffer_traits<FrameBuffer>::width,
+    buffer_traits<FrameBuffer>::height,
+    buffer_traits<FrameBuffer>::luma_offset,
+    buffer_traits<FrameBuffer>::chroma_offset
+  };
+
+  p.hor_pic_size_in_mbs            = sps.pic_width_in_mbs_minus1 + 1;
+  p.vert_pic_size_in_mbs           = (sps.pic_height_in_map_units_minus1 + 1) * (2 - sps.frame_mbs_only_flag);
+  p.mb_mode                        = sps.chroma_format_idc == 1 ? 0 : 1;
+  p.frame_mbs_only_flag            = sps.frame_mbs_only_flag;
+  p.mbaff_frame_flag               = sps.mb_adaptive_frame_field_flag;
+  p.direct_8x8_inference_flag      = sps.direct_8x8_inference_flag;
+  p.max_num_ref_frames             = sps.max_num_ref_frames;
+
+  if(pps.scaling_matrix) 
+    p.scaling_list                 = reinterpret_cast<msvd_h264_scaling_lists const*>(&*pps.scaling_matrix);
+  else if(sps.scaling_matrix)
+    p.scaling_list                 = reinterpret_cast<msvd_h264_scaling_lists const*>(&*sps.scaling_matrix);
+  else
+    p.scaling_list = 0;
+
+  p.constr_intra_pred_flag         = pps.constrained_intra_pred_flag;    
+  p.transform_8x8_mode_flag        = pps.transform_8x8_mode_flag;
+  p.entropy_coding_mode_flag       = pps.entropy_coding_mode_flag;
+  p.chroma_qp_index_offset         = pps.chroma_qp_index_offset;
+  p.second_chroma_qp_index_offset  = pps.second_chroma_qp_index_offset;
+
+  return p;
+}
+
 template<typename Sequence> 
 struct h264_context : public msvd_h264_decode_params, public msvd_decode_result {
+  h264_context() {}
+
   template<typename I, typename Frame>
   h264_context(
     h264::seq_parameter_set const& sps,
@@ -233,20 +480,31 @@ struct h264_context : public msvd_h264_decode_params, public msvd_decode_result
     I frames_begin, I frames_end,
     Frame const& curr_pic,
     Sequence const& slice_data,
-    std::size_t slice_data_offset)
+    std::size_t slice_data_offset,
+    h264::initial_reflists<I> const* initial = nullptr)
   {
-    using namespace h264;
-
-    memset(this, 0, sizeof(*this));
-
     using frame_buffer_type = typename std::decay<decltype(frame_buffer(curr_pic))>::type;
+    assign(make_h264_parameters<frame_buffer_type>(sps, pps), sps, pps, slice, frames_begin, frames_end, curr_pic, slice_data, slice_data_offset, initial);
+  }
 
-    geometry = {
-      buffer_traits<frame_buffer_type>::width,
-      buffer_traits<frame_buffer_type>::height,
-      buffer_traits<frame_buffer_type>::luma_offset,
-      buffer_traits<frame_buffer_type>::chroma_offset
-    };
+  // writes the fields that change per slice over parameters made for the same sps and pps, the
+  // dpb and reference list arrays are filled only as far as they are used
+  template<typename I, typename Frame>
+  void assign(
+    msvd_h264_decode_params const& parameters,
+    h264::seq_parameter_set const& sps,
+    h264::pic_parameter_set const& pps,
+    h264::slice_header const& slice,
+    I frames_begin, I frames_end,
+    Frame const& curr_pic,
+    Sequence const& slice_data,
+    std::size_t slice_data_offset,
+    h264::initial_reflists<I> const* initial = nullptr)
+  {
+    using namespace h264;
+
+    static_cast<msvd_h264_decode_params&>(*this) = parameters;
+    static_cast<msvd_decode_result&>(*this) = msvd_decode_result{};
 
     decoded_picture_buffer_size = std::transform(frames_begin, frames_end, dpb_data, 
       [&](decltype(*frames_begin)& f) { 
@@ -260,14 +518,20 @@ struct h264_context : public msvd_h264_decode_params, public msvd_decode_result
     std::array<picture_reference<I>, 32> rl[2];
     picture_reference<I>* rl_end[2] = {rl[0].begin(), rl[1].begin()};
 
+    // the initial lists are computed here unless they are shared by the slices of the picture
+    auto frames = utils::make_range(frames_begin, frames_end);
+    initial_reflists<I> lists;
+
     if(slice.slice_type == coding_type::P) {
-      rl_end[0] = generate_reflist_for_p_slice(MaxFrameNum(sps), curr_pic, utils::make_range(frames_begin, frames_end),
+      if(!initial) initial = &(lists = initialise_reflists_for_p_slice(MaxFrameNum(sps), curr_pic, frames));
+      rl_end[0] = generate_reflist_for_p_slice(MaxFrameNum(sps), curr_pic, frames, *initial,
         utils::make_range(slice.ref_pic_list_modification[0]),
         rl[0].begin(), slice.num_ref_idx_l0_active_minus1 + 1);
     }
     else if(slice.slice_type == coding_type::B) {
+      if(!initial) initial = &(lists = initialise_reflists_for_b_slice(curr_pic, frames));
       std::tie(rl_end[0], rl_end[1]) = 
-        generate_reflists_for_b_slice(MaxFrameNum(sps), curr_pic, utils::make_range(frames_begin, frames_end),
+        generate_reflists_for_b_slice(MaxFrameNum(sps), curr_pic, frames, *initial,
           utils::make_range(slice.ref_pic_list_modification[0]), 
           utils::make_range(slice.ref_pic_list_modification[1]),
           rl[0].begin(), slice.num_ref_idx_l0_active_minus1 + 1,
@@ -307,27 +571,7 @@ struct h264_context : public msvd_h264_decode_params, public msvd_decode_result
       col_abs_diff_poc_flag = abs(TopFieldOrderCnt(*rl[1][0].frame) - PicOrderCnt(curr_pic)) >= abs(BotFieldOrderCnt(*rl[1][0].frame) - PicOrderCnt(curr_pic));
     }
   
-    hor_pic_size_in_mbs            = sps.pic_width_in_mbs_minus1 + 1;
-    vert_pic_size_in_mbs           = (sps.pic_height_in_map_units_minus1 + 1) * (2 - sps.frame_mbs_only_flag);
-    mb_mode                        = sps.chroma_format_idc == 1 ? 0 : 1;
-    frame_mbs_only_flag            = sps.frame_mbs_only_flag;
-    mbaff_frame_flag               = sps.mb_adaptive_frame_field_flag;
-    direct_8x8_inference_flag      = sps.direct_8x8_inference_flag;
-    max_num_ref_frames             = sps.max_num_ref_frames;
-
-    if(pps.scaling_matrix) 
-      scaling_list                 = reinterpret_cast<msvd_h264_scaling_lists const*>(&*pps.scaling_matrix);
-    else if(sps.scaling_matrix)
-      scaling_list                 = reinterpret_cast<msvd_h264_scaling_lists const*>(&*sps.scaling_matrix);
-    else
-      scaling_list = 0;
-  
-    constr_intra_pred_flag         = pps.constrained_intra_pred_flag;    
-    transform_8x8_mode_flag        = pps.transform_8x8_mode_flag;
-    entropy_coding_mode_flag       = pps.entropy_coding_mode_flag;
     weight_mode                    = slice.slice_type == coding_type::B ? pps.weighted_bipred_idc : pps.weighted_pred_flag;
-    chroma_qp_index_offset         = pps.chroma_qp_index_offset;
-    second_chroma_qp_index_offset  = pps.second_chroma_qp_index_offset;
 
     picture_type                   = to_msvd(slice.pic_type);
     slice_type                     = to_msvd(slice.slice_type);
@@ -353,6 +597,39 @@ struct h264_context : public msvd_h264_decode_params, public msvd_decode_result
   decltype(bitstream::adapt_sequence(std::declval<Sequence>())) buffers;
 };
 
+// Keeps h264_context objects of finished slices for reuse, so steady state decoding does
+// not allocate. The pool must outlive the contexts it hands out and is not thread safe.
+template<typename Sequence>
+class h264_context_pool {
+public:
+  struct recycler {
+    h264_context_pool* pool;
+    void operator()(h264_context<Sequence>* cx) const { pool->free.emplace_back(cx); }
+  };
+
+  using pointer = std::unique_ptr<h264_context<Sequence>, recycler>;
+
+  h264_context_pool() = default;
+  h264_context_pool(h264_context_pool const&) = delete;
+  h264_context_pool& operator=(h264_context_pool const&) = delete;
+
+  pointer allocate() {
+    if(free.empty()) return pointer(new h264_context<Sequence>, recycler{this});
+
+    auto cx = free.back().release();
+    free.pop_back();
+    return pointer(cx, recycler{this});
+  }
+
+  static h264_context_pool& default_pool() {
+    static h264_context_pool pool;
+    return pool;
+  }
+
+private:
+  std::vector<std::unique_ptr<h264_context<Sequence>>> free;
+};
+
 template<typename Pr, typename Rs, typename F>
 auto async_decode_slice(decoder& d, Pr pr, Rs rs, F callback) -> std::enable_if_t<
   std::is_convertible<decltype(*pr), msvd_h264_decode_params>::value
@@ -378,8 +655,9 @@ auto async_decode_slice(decoder& d, Pr pr, Rs rs, F callback) -> std::enable_if_
     });
 }
 
-template<typename S, typename F>
-auto async_decode_slice(decoder& d, std::unique_ptr<h264_context<S>> cx, F callback) ->
+// Decoder is the msvd decoder or a slice_queue in front of it
+template<typename Decoder, typename S, typename D, typename F>
+auto async_decode_slice(Decoder& d, std::unique_ptr<h264_context<S>, D> cx, F callback) ->
   typename std::enable_if<utils::is_callable<F(std::error_code, msvd::decode_result)>::value>::type
 {
   auto r = cx.get();
@@ -418,8 +696,13 @@ auto async_decode_slice(
   std::size_t slice_data_offset,
   Callback callback) -> typename std::enable_if<utils::is_callable<Callback(std::error_code, msvd::decode_result)>::value>::type
 {
-  async_decode_slice(d, cx.sps(), cx.pps(), cx.slice(), *cx.current_picture(), cx.begin(), cx.end(), 
-    slice_data, slice_data_offset, callback);
+  detail::async_decode_slice(
+    d,
+    std::unique_ptr<detail::h264_context<Sequence>>(
+      new detail::h264_context<Sequence>(cx.sps(), cx.pps(), cx.slice(), cx.begin(), cx.end(), *cx.current_picture(), slice_data, slice_data_offset,
+        cx.reflists(cx.slice().slice_type, MaxFrameNum(cx.sps())))
+    ),
+    callback);
 }
 
 template<typename FrameBuffer, typename FrameBufferAllocator, typename Sequence, typename Callback>
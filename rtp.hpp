@@ -2,51 +2,118 @@
 #define __rtp_a271e547_1eab_4fa6_b13b_4598570fe259_hpp__
 
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
 #include <chrono>
+#include <array>
+#include <algorithm>
 #include <vector>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <errno.h>
 
 #include "mpeg.hpp"
+#include "h264-syntax.hpp"
+#include "ts.hpp"
+#include "types.hpp"
 #include "utils.hpp"
 
 namespace rtp {
 
-class udp_packet {
-  static constexpr std::size_t storage_size = 1500-5*4-2*4; // ethernet mtu - ip header - udp header
-  std::unique_ptr<std::uint8_t[]> data;
-  std::size_t used = 0;
+// MTU sized slots for udp payloads carved out of slabs of slots_per_slab each. Slots are
+// reference counted and go back to the free list when the last packet referring to them
+// is released, so steady state reception never touches the allocator. The pool must
+// outlive its packets and, like the rest of the library, is not thread safe.
+class packet_pool {
 public:
-  constexpr udp_packet() = default;
-  udp_packet(udp_packet&&) = default;
-  udp_packet& operator=(udp_packet&&) = default;
+  static constexpr std::size_t slot_size = 1500-5*4-2*4; // ethernet mtu - ip header - udp header
+  static constexpr std::size_t slots_per_slab = 256;
+
+  struct slot {
+    std::uint8_t data[slot_size];
+    std::size_t refs = 0;
+    packet_pool* pool = nullptr;
+    slot* next_free = nullptr;
+
+    friend void intrusive_ptr_add_ref(slot* s) { ++s->refs; }
+    friend void intrusive_ptr_release(slot* s) {
+      if(--s->refs == 0) s->pool->recycle(s);
+    }
+  };
+
+  packet_pool() = default;
+  packet_pool(packet_pool const&) = delete;
+  packet_pool& operator=(packet_pool const&) = delete;
+
+  utils::intrusive_ptr<slot> allocate() {
+    if(!free_list) grow();
+    auto s = free_list;
+    free_list = s->next_free;
+    --available;
+    return utils::intrusive_ptr<slot>(s);
+  }
+
+  std::size_t size() const { return slabs.size() * slots_per_slab; }
+  std::size_t free() const { return available; }
+
+  static packet_pool& default_pool() {
+    static packet_pool pool;
+    return pool;
+  }
+
+private:
+  friend void intrusive_ptr_release(slot*);
 
-  udp_packet(udp_packet const& p) : udp_packet() {
-    reserve();
-    memcpy(begin(), p.begin(), p.used);
-    used = p.used;
+  void grow() {
+    slabs.emplace_back(new slot[slots_per_slab]);
+    for(auto i = slots_per_slab; i != 0; --i) {
+      auto& s = slabs.back()[i-1];
+      s.pool = this;
+      recycle(&s);
+    }
   }
 
-  udp_packet& operator=(udp_packet const& p) {
-    resize(p.size());
-    memcpy(begin(), p.begin(), p.used);
-    return *this;
+  void recycle(slot* s) {
+    s->next_free = free_list;
+    free_list = s;
+    ++available;
   }
 
-  std::uint8_t* begin() { return &data[0]; }
+  std::vector<std::unique_ptr<slot[]>> slabs;
+  slot* free_list = nullptr;
+  std::size_t available = 0;
+};
+
+// A udp datagram held in a packet_pool slot. Copies share the slot, the payload is meant
+// to be written once when the datagram is received.
+class udp_packet {
+  static constexpr std::size_t storage_size = packet_pool::slot_size;
+  utils::intrusive_ptr<packet_pool::slot> data;
+  std::size_t used = 0;
+public:
+  udp_packet() = default;
+  udp_packet(udp_packet&&) = default;
+  udp_packet& operator=(udp_packet&&) = default;
+  udp_packet(udp_packet const&) = default;
+  udp_packet& operator=(udp_packet const&) = default;
+
+  std::uint8_t* begin() { return data ? data->data : nullptr; }
   std::uint8_t* end() { return begin() + used; }
-  std::uint8_t* end_of_storage() { return begin() + storage_size; }
+  std::uint8_t* end_of_storage() { return begin() + capacity(); }
 
-  std::uint8_t const* begin() const { return &data[0]; }
+  std::uint8_t const* begin() const { return data ? data->data : nullptr; }
   std::uint8_t const* end() const { return begin() + used; }
-  std::uint8_t const* end_of_storage() const { return begin() + storage_size; }
+  std::uint8_t const* end_of_storage() const { return begin() + capacity(); }
 
   bool empty() const noexcept { return begin() == end(); }
 
   std::size_t capacity() const noexcept { return data ? storage_size : 0; } 
   std::size_t size() const noexcept { return used; }
  
-  void reserve() { 
-    if(!data) 
-      data = decltype(data)(new std::uint8_t[storage_size]); 
+  void reserve(packet_pool& pool = packet_pool::default_pool()) { 
+    if(!data) data = pool.allocate();
   }
 
   void resize(std::size_t n) {
@@ -55,6 +122,9 @@ public:
     used = n;
   }
 
+  // true if no other packet shares the slot, i.e. it can be refilled in place
+  bool unique() const noexcept { return data && data->refs == 1; }
+
   constexpr static std::size_t max_size() noexcept { return storage_size; }
 
   friend bool operator == (udp_packet const& a, udp_packet const& b) {
@@ -81,6 +151,55 @@ public:
   }
 };
 
+// Receives up to N datagrams from a nonblocking udp socket with a single recvmmsg call.
+// Packets still owned by the caller are refilled in place, shared ones get a fresh slot
+// from the pool. Returns the number of packets filled, 0 if nothing was pending.
+template<std::size_t N>
+std::size_t receive(int fd, std::array<udp_packet, N>& packets, std::error_code& ec, 
+  packet_pool& pool = packet_pool::default_pool())
+{
+  std::array<mmsghdr, N> headers;
+  std::array<iovec, N> iov;
+
+  for(std::size_t i = 0; i != N; ++i) {
+    auto& p = packets[i];
+    if(!p.unique()) p = udp_packet{};
+    p.reserve(pool);
+    iov[i] = {p.begin(), p.capacity()};
+    headers[i] = {};
+    headers[i].msg_hdr.msg_iov = &iov[i];
+    headers[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  ec = std::error_code{};
+  auto n = ::recvmmsg(fd, headers.data(), N, MSG_DONTWAIT, nullptr);
+  if(n < 0) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK) ec = std::error_code(errno, std::system_category());
+    return 0;
+  }
+
+  for(std::size_t i = 0; i != std::size_t(n); ++i)
+    packets[i].resize(headers[i].msg_len);
+
+  return n;
+}
+
+// Waits for the socket to become readable and drains it with receive() in batches of N.
+// cb(error_code, std::size_t) is called for every batch and must consume the packets
+// before returning, it is not called for an empty batch.
+template<typename Socket, std::size_t N, typename Callback>
+void async_receive(Socket& socket, std::array<udp_packet, N>& packets, Callback cb) {
+  socket.async_receive(asio::null_buffers(), [&socket, &packets, cb](std::error_code const& e, std::size_t) mutable {
+    if(e) return cb(e, 0);
+
+    std::error_code ec;
+    while(auto n = receive(socket.native_handle(), packets, ec)) cb(ec, n);
+    if(ec) return cb(ec, 0);
+
+    async_receive(socket, packets, std::move(cb));
+  });
+}
+
 struct rtp_header {
   net32_t storage[3];
 
@@ -92,9 +211,9 @@ struct rtp_header {
   unsigned  pt() const { return get( 9.7_bf, storage[0]); }
   unsigned  sequence_number() const { return get(16.16_bf, storage[0]); }
 
-  std::uint32_t ssrc() const { return get(0.32_bf, storage[1]); }
-  std::uint32_t timestamp() const { return get(0.32_bf, storage[2]); }
-  std::uint32_t csrc(std::size_t n) const { return get(0.32_bf, storage[2+n]); }
+  std::uint32_t timestamp() const { return get(0.32_bf, storage[1]); }
+  std::uint32_t ssrc() const { return get(0.32_bf, storage[2]); }
+  std::uint32_t csrc(std::size_t n) const { return get(0.32_bf, storage[3+n]); }
 
   std::size_t header_size() const { return sizeof(*this) + cc()*sizeof(std::uint32_t); }
 };
@@ -147,6 +266,608 @@ inline constexpr bool sequence_number_compare(std::uint16_t a, std::uint16_t b)
   return std::int16_t(b - a) > 0;
 }
 
+// Reorders rtp packets by sequence number. Packets are kept in a ring of N slots indexed by
+// sequence_number mod N and released strictly in sequence order: the next packet is released
+// as soon as it is present, a missing one is waited for at most the playout delay measured
+// from the arrival of the first packet behind the gap. The delay follows the interarrival
+// jitter estimate of rfc3550 A.8, bounded by the configured minimum and maximum.
+template<std::size_t N = 512>
+struct jitter_buffer {
+  static_assert(N && (N & (N - 1)) == 0 && N <= 0x8000, "jitter_buffer capacity must be a power of two not above 2^15");
+
+  using clock = std::chrono::steady_clock;
+
+  struct statistics {
+    std::uint64_t received = 0;
+    std::uint64_t released = 0;
+    std::uint64_t lost = 0;       // sequence numbers skipped after the playout delay expired
+    std::uint64_t reordered = 0;  // packets arrived after a packet with a higher sequence number
+    std::uint64_t late = 0;       // packets arrived after their sequence number was released or skipped
+    std::uint64_t duplicates = 0;
+    std::uint64_t overflows = 0;  // packets dropped because the sequence number span exceeded N
+    std::uint64_t repaired = 0;   // packets inserted with repair()
+    std::chrono::microseconds jitter{0};
+    std::chrono::microseconds playout_delay{0};
+  };
+
+  jitter_buffer(std::chrono::microseconds min_delay = std::chrono::milliseconds(20),
+                std::chrono::microseconds max_delay = std::chrono::milliseconds(200),
+                std::uint32_t clock_rate = 90000) :
+    min_delay(min_delay), max_delay(max_delay), clock_rate(clock_rate)
+  {
+    counters.playout_delay = min_delay;
+  }
+
+  void push(rtp_packet p, clock::time_point arrival = clock::now()) {
+    if(p.empty()) return;
+    ++counters.received;
+
+    update_jitter(p.timestamp(), arrival);
+    insert(std::move(p), arrival, false);
+  }
+
+  // inserts a packet repaired by retransmission or fec, it takes no part in the jitter estimate
+  void repair(rtp_packet p, clock::time_point arrival = clock::now()) {
+    if(p.empty()) return;
+    ++counters.repaired;
+
+    insert(std::move(p), arrival, true);
+  }
+
+  // releases the next packet in sequence order if it is due, otherwise returns an empty packet
+  rtp_packet pop(clock::time_point now = clock::now()) {
+    if(count == 0) return rtp_packet();
+
+    if(slot(head).empty()) {
+      if(!gap_since || now - *gap_since < playout_delay()) return rtp_packet();
+      
+      while(slot(head).empty()) {
+        ++counters.lost;
+        ++head;
+      }
+    }
+
+    auto r = std::move(slot(head));
+    slot(head) = rtp_packet();
+    --count;
+    ++head;
+    ++counters.released;
+
+    gap_since = utils::nullopt;
+    if(count != 0 && slot(head).empty()) {
+      auto i = head;
+      while(slot(i).empty()) ++i;
+      gap_since = arrivals[i % N];
+    }
+
+    return r;
+  }
+
+  // time point at which pop() may release a packet, nullopt if the buffer is empty
+  utils::optional<clock::time_point> next_release() const {
+    if(count == 0) return utils::nullopt;
+    if(!slot(head).empty() || !gap_since) return clock::time_point::min();
+    return *gap_since + playout_delay();
+  }
+
+  std::chrono::microseconds playout_delay() const { return counters.playout_delay; }
+
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  friend statistics const& stats(jitter_buffer const& jb) { return jb.counters; }
+
+private:
+  void insert(rtp_packet p, clock::time_point arrival, bool repaired) {
+    std::uint16_t seq = p.sequence_number();
+    if(!started) {
+      started = true;
+      head = highest = seq;
+    }
+
+    if(sequence_number_compare(seq, head)) {
+      ++counters.late;
+      return;
+    }
+
+    if(std::uint16_t(seq - head) >= N) {
+      // the sender ran ahead of the window, give up on everything that doesn't fit
+      while(std::uint16_t(seq - head) >= N) {
+        if(!slot(head).empty()) {
+          slot(head) = rtp_packet();
+          --count;
+          ++counters.overflows;
+        }
+        ++head;
+      }
+      gap_since = utils::nullopt;
+    }
+
+    auto& s = slot(seq);
+    if(!s.empty()) {
+      ++counters.duplicates;
+      return;
+    }
+
+    if(!sequence_number_compare(seq, highest))
+      highest = seq;
+    else if(!repaired)
+      ++counters.reordered;
+
+    s = std::move(p);
+    arrivals[seq % N] = arrival;
+    ++count;
+
+    if(seq != head && !gap_since) gap_since = arrival;
+  }
+
+  rtp_packet& slot(std::uint16_t seq) { return slots[seq % N]; }
+  rtp_packet const& slot(std::uint16_t seq) const { return slots[seq % N]; }
+
+  void update_jitter(std::uint32_t timestamp, clock::time_point arrival) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(arrival.time_since_epoch()).count();
+    auto transit = std::int32_t(std::uint32_t(us * clock_rate / 1000000) - timestamp);
+
+    if(prev_transit) {
+      auto d = std::abs(double(std::int32_t(std::uint32_t(transit) - std::uint32_t(*prev_transit))));
+      jitter += (d - jitter) / 16;
+    }
+    prev_transit = transit;
+
+    counters.jitter = std::chrono::microseconds(std::int64_t(jitter * 1000000 / clock_rate));
+    counters.playout_delay = std::max(min_delay, std::min(max_delay, 4 * counters.jitter));
+  }
+
+  std::array<rtp_packet, N> slots;
+  std::array<clock::time_point, N> arrivals;
+
+  bool started = false;
+  std::uint16_t head = 0;
+  std::uint16_t highest = 0;
+  std::size_t count = 0;
+  utils::optional<clock::time_point> gap_since;
+
+  std::chrono::microseconds min_delay;
+  std::chrono::microseconds max_delay;
+  std::uint32_t clock_rate;
+  utils::optional<std::int32_t> prev_transit;
+  double jitter = 0;
+
+  statistics counters;
+};
+
+namespace rtcp {
+
+enum class packet_type : unsigned {
+  sr    = 200,
+  rr    = 201,
+  sdes  = 202,
+  bye   = 203,
+  app   = 204,
+  rtpfb = 205,
+  psfb  = 206
+};
+
+// rfc3550 6.4.1, count is rc, sc or fmt depending on the packet type
+struct header {
+  net32_t storage[1];
+
+  unsigned v()      const { return get( 0.2_bf,  storage[0]); }
+  bool     p()      const { return get( 2.1_bf,  storage[0]); }
+  unsigned count()  const { return get( 3.5_bf,  storage[0]); }
+  unsigned pt()     const { return get( 8.8_bf,  storage[0]); }
+  unsigned length() const { return get(16.16_bf, storage[0]); }
+
+  std::size_t size() const { return (length() + 1) * sizeof(std::uint32_t); }
+};
+
+// rfc3550 6.4.1, follows the header and the sender's ssrc
+struct sender_info {
+  net32_t storage[5];
+
+  std::uint32_t ntp_msw()       const { return get(0.32_bf, storage[0]); }
+  std::uint32_t ntp_lsw()       const { return get(0.32_bf, storage[1]); }
+  std::uint32_t rtp_timestamp() const { return get(0.32_bf, storage[2]); }
+  std::uint32_t packet_count()  const { return get(0.32_bf, storage[3]); }
+  std::uint32_t octet_count()   const { return get(0.32_bf, storage[4]); }
+};
+
+// ntp timestamps count from 1900
+using ntp_time = std::chrono::duration<std::int64_t, std::nano>;
+
+const ntp_time unix_epoch = std::chrono::seconds(2208988800u);
+
+inline
+ntp_time to_ntp_time(std::uint32_t msw, std::uint32_t lsw) {
+  return std::chrono::seconds(msw) + ntp_time((std::uint64_t(lsw) * 1000000000) >> 32);
+}
+
+inline
+std::chrono::system_clock::time_point to_system_time(ntp_time t) {
+  return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(t - unix_epoch));
+}
+
+struct sender_report {
+  std::uint32_t ssrc;
+  ntp_time ntp_timestamp;
+  std::uint32_t rtp_timestamp;
+  std::uint32_t packet_count;
+  std::uint32_t octet_count;
+};
+
+// calls f(header const&, std::uint8_t const* first, std::uint8_t const* last) for every packet
+// of a compound rtcp packet, false if the compound packet is malformed
+template<typename F>
+bool for_each_packet(std::uint8_t const* first, std::uint8_t const* last, F f) {
+  while(first != last) {
+    if(std::size_t(last - first) < sizeof(header)) return false;
+    
+    auto const& h = *reinterpret_cast<header const*>(first);
+    if(h.v() != 2 || h.size() > std::size_t(last - first)) return false;
+
+    f(h, first, first + h.size());
+    first += h.size();
+  }
+  return true;
+}
+
+inline
+utils::optional<sender_report> parse_sender_report(header const& h, std::uint8_t const* first, std::uint8_t const* last) {
+  if(h.pt() != unsigned(packet_type::sr) || std::size_t(last - first) < sizeof(header) + sizeof(net32_t) + sizeof(sender_info)) 
+    return utils::nullopt;
+
+  auto ssrc = get(0.32_bf, *reinterpret_cast<net32_t const*>(first + sizeof(header)));
+  auto const& si = *reinterpret_cast<sender_info const*>(first + sizeof(header) + sizeof(net32_t));
+
+  return sender_report{ssrc, to_ntp_time(si.ntp_msw(), si.ntp_lsw()), si.rtp_timestamp(), si.packet_count(), si.octet_count()};
+}
+
+// rfc4585 6.2.1
+const unsigned generic_nack_fmt = 1;
+
+namespace detail {
+
+inline
+std::uint8_t* put16(std::uint8_t* p, std::uint16_t v) {
+  *p++ = v >> 8;
+  *p++ = v;
+  return p;
+}
+
+inline
+std::uint8_t* put32(std::uint8_t* p, std::uint32_t v) {
+  return put16(put16(p, v >> 16), v);
+}
+
+}
+
+} // namespace rtcp
+
+// Requests retransmission of the lost packets of an rtp stream with rfc4585 generic nacks
+// and unwraps the repairs arriving on its rfc4588 retransmission stream. Gaps are detected
+// from the sequence numbers of received packets. A missing packet is first requested after
+// reorder_delay, then every retry_interval up to max_requests times, and given up when it
+// is still missing after that or leaves the window of N sequence numbers. Requests due at
+// the same time are coalesced into the pid/blp entries of one nack, nacks are sent at most
+// every min_interval. Nacks are sent without a leading receiver report (rfc5506).
+template<std::size_t N = 512>
+struct retransmission_client {
+  static_assert(N && (N & (N - 1)) == 0 && N <= 0x8000, "retransmission_client window must be a power of two not above 2^15");
+
+  using clock = std::chrono::steady_clock;
+
+  static constexpr std::size_t max_fci = 64;
+
+  struct statistics {
+    std::uint64_t requested = 0;  // sequence numbers requested, retries included
+    std::uint64_t nacks = 0;
+    std::uint64_t repaired = 0;   // missing packets arrived on the retransmission stream
+    std::uint64_t recovered = 0;  // missing packets arrived late on the media stream
+    std::uint64_t abandoned = 0;  // missing packets given up
+    std::uint64_t rtcp_bytes = 0;
+    std::uint64_t rtx_bytes = 0;
+  };
+
+  explicit retransmission_client(std::uint32_t ssrc,
+    std::chrono::microseconds reorder_delay = std::chrono::milliseconds(2),
+    std::chrono::microseconds retry_interval = std::chrono::milliseconds(30),
+    std::chrono::microseconds min_interval = std::chrono::milliseconds(5),
+    unsigned max_requests = 3) :
+    ssrc(ssrc), reorder_delay(reorder_delay), retry_interval(retry_interval), min_interval(min_interval), max_requests(max_requests)
+  {}
+
+  // to be called for every packet of the media stream
+  void received(rtp_packet const& p, clock::time_point now = clock::now()) {
+    if(p.empty()) return;
+
+    std::uint16_t seq = p.sequence_number();
+
+    if(!started) {
+      started = true;
+      highest = oldest = seq;
+      media_ssrc = p.ssrc();
+      media_pt = p.pt();
+      return;
+    }
+
+    if(sequence_number_compare(highest, seq)) {
+      if(std::uint16_t(seq - highest) >= N) {
+        // too far ahead to be a gap worth repairing, start over
+        for(auto& r: requests) forget(r);
+        highest = oldest = seq;
+        return;
+      }
+      
+      for(std::uint16_t s = highest + 1; s != seq; ++s) {
+        auto& r = slot(s);
+        forget(r);
+        r = {s, true, 0, now + reorder_delay};
+        ++missing;
+      }
+      forget(slot(seq));
+      highest = seq;
+
+      if(std::uint16_t(highest - oldest) >= N) oldest = highest - N + 1;
+    }
+    else if(is_missing(seq)) {
+      ++counters.recovered;
+      clear(slot(seq));
+    }
+  }
+
+  // unwraps a packet of the retransmission stream into the original one, which is meant
+  // for jitter_buffer::repair()
+  rtp_packet repair(rtp_packet const& rtx) {
+    if(rtx.empty() || rtx.end() - rtx.begin() < 2) return rtp_packet();
+    counters.rtx_bytes += rtx.size();
+
+    auto osn = std::uint16_t((rtx.begin()[0] << 8) | rtx.begin()[1]);
+    auto header_size = std::size_t(rtx.begin() - rtx.udp_packet::begin());
+
+    udp_packet u;
+    u.resize(rtx.size() - 2);
+    std::memcpy(u.begin(), rtx.udp_packet::begin(), header_size);
+    std::memcpy(u.begin() + header_size, rtx.begin() + 2, rtx.udp_packet::end() - rtx.begin() - 2);
+
+    auto d = u.begin();
+    d[1] = (d[1] & 0x80) | media_pt;
+    rtcp::detail::put16(d + 2, osn);
+    rtcp::detail::put32(d + 8, media_ssrc);
+
+    if(is_missing(osn)) {
+      ++counters.repaired;
+      clear(slot(osn));
+    }
+
+    return rtp_packet::parse(std::move(u));
+  }
+
+  // a nack for the requests that are due, an empty buffer if there are none or the
+  // previous nack was sent less than min_interval ago; valid until the next call
+  asio::const_buffer poll(clock::time_point now = clock::now()) {
+    if(!missing || (last_sent && now - *last_sent < min_interval)) return asio::const_buffer();
+
+    std::size_t fci = 0;
+    auto out = buffer.data() + 3 * sizeof(std::uint32_t);
+
+    for(std::uint16_t s = oldest, end = highest + 1; s != end && fci != max_fci; ++s) {
+      auto& r = slot(s);
+      if(!is_missing(s) || r.due > now) continue;
+
+      if(r.count == max_requests) {
+        ++counters.abandoned;
+        clear(r);
+        continue;
+      }
+
+      request(r, now);
+
+      std::uint16_t blp = 0;
+      for(unsigned k = 1; k != 17 && std::uint16_t(s + k) != end; ++k) {
+        auto& n = slot(s + k);
+        if(is_missing(s + k) && n.due <= now && n.count != max_requests) {
+          blp |= 1 << (k - 1);
+          request(n, now);
+        }
+      }
+
+      out = rtcp::detail::put16(rtcp::detail::put16(out, s), blp);
+      ++fci;
+
+      if(sequence_number_compare(std::uint16_t(s + 16), end)) s += 16;
+      else break;
+    }
+
+    while(oldest != std::uint16_t(highest + 1) && !is_missing(oldest)) ++oldest;
+
+    if(!fci) return asio::const_buffer();
+
+    auto p = buffer.data();
+    p = rtcp::detail::put16(p, (2 << 14) | (rtcp::generic_nack_fmt << 8) | unsigned(rtcp::packet_type::rtpfb));
+    p = rtcp::detail::put16(p, 2 + fci);
+    p = rtcp::detail::put32(p, ssrc);
+    p = rtcp::detail::put32(p, media_ssrc);
+
+    last_sent = now;
+    ++counters.nacks;
+    counters.rtcp_bytes += out - buffer.data();
+
+    return asio::const_buffer(buffer.data(), out - buffer.data());
+  }
+
+  // time point at which poll() may have a nack to send, nullopt if nothing is missing
+  utils::optional<clock::time_point> next_poll() const {
+    if(!missing) return utils::nullopt;
+
+    auto t = clock::time_point::max();
+    for(std::uint16_t s = oldest, end = highest + 1; s != end; ++s)
+      if(is_missing(s)) t = std::min(t, slot(s).due);
+
+    if(last_sent) t = std::max(t, *last_sent + min_interval);
+    return t;
+  }
+
+  std::size_t size() const { return missing; }
+
+  friend statistics const& stats(retransmission_client const& c) { return c.counters; }
+
+private:
+  struct request_state {
+    std::uint16_t seq;
+    bool missing;
+    unsigned count;
+    clock::time_point due;
+  };
+
+  request_state& slot(std::uint16_t seq) { return requests[seq % N]; }
+  request_state const& slot(std::uint16_t seq) const { return requests[seq % N]; }
+
+  bool is_missing(std::uint16_t seq) const {
+    auto const& r = slot(seq);
+    return r.missing && r.seq == seq;
+  }
+
+  void clear(request_state& r) {
+    r.missing = false;
+    --missing;
+  }
+
+  // drops a request that left the window
+  void forget(request_state& r) {
+    if(!r.missing) return;
+    ++counters.abandoned;
+    clear(r);
+  }
+
+  void request(request_state& r, clock::time_point now) {
+    ++r.count;
+    r.due = now + retry_interval;
+    ++counters.requested;
+  }
+
+  std::uint32_t ssrc;
+  std::chrono::microseconds reorder_delay;
+  std::chrono::microseconds retry_interval;
+  std::chrono::microseconds min_interval;
+  unsigned max_requests;
+
+  std::array<request_state, N> requests{};
+  std::size_t missing = 0;
+  
+  bool started = false;
+  std::uint16_t highest = 0;
+  std::uint16_t oldest = 0;
+  std::uint32_t media_ssrc = 0;
+  unsigned media_pt = 0;
+
+  utils::optional<clock::time_point> last_sent;
+  std::array<std::uint8_t, 3 * sizeof(std::uint32_t) + max_fci * sizeof(std::uint32_t)> buffer;
+
+  statistics counters;
+};
+
+// Extends the 32 bit timestamps of an rtp stream to 64 bits. Every timestamp is taken
+// relative to the previous one, so the result keeps counting across wraparounds.
+struct timestamp_unwrapper {
+  std::int64_t operator()(std::uint32_t ts) {
+    value = peek(ts);
+    previous = ts;
+    return value;
+  }
+
+  // unwraps ts without taking it as the new reference
+  std::int64_t peek(std::uint32_t ts) const {
+    return previous ? value + std::int32_t(ts - *previous) : ts;
+  }
+
+  utils::optional<std::uint32_t> previous;
+  std::int64_t value = 0;
+};
+
+// Puts the streams of an rtp session on one timeline with the rtp/ntp timestamp pairs of
+// their sender reports. Session time counts from the ntp time of the first sender report,
+// so streams of different ssrcs and clock rates can be scheduled on one media::system_clock
+// and stay in sync; timestamps are unwrapped per stream and never wrap in session time.
+class session_clock {
+public:
+  void add_stream(std::uint32_t ssrc, std::uint32_t clock_rate) {
+    if(!find(ssrc)) streams.push_back(stream{ssrc, clock_rate});
+  }
+
+  // applies the sender reports of a compound rtcp packet, false if it is malformed
+  bool push(asio::const_buffer const& rtcp) {
+    auto first = asio::buffer_cast<std::uint8_t const*>(rtcp);
+    return rtcp::for_each_packet(first, first + asio::buffer_size(rtcp), [this](rtcp::header const& h, std::uint8_t const* b, std::uint8_t const* e) {
+      if(auto sr = rtcp::parse_sender_report(h, b, e)) push(*sr);
+    });
+  }
+
+  void push(rtcp::sender_report const& sr) {
+    auto s = find(sr.ssrc);
+    if(!s) return;
+
+    if(!session_epoch) session_epoch = sr.ntp_timestamp;
+
+    s->reference = s->unwrap.previous ? s->unwrap.peek(sr.rtp_timestamp) : s->unwrap(sr.rtp_timestamp);
+    s->reference_time = sr.ntp_timestamp;
+  }
+
+  // session time of a packet, nullopt until its stream had a sender report. To be called
+  // for every packet of the stream, in arrival or sequence order.
+  utils::optional<media::timestamp> operator()(rtp_packet const& p) {
+    auto t = sample_time(p);
+    if(!t) return utils::nullopt;
+
+    auto d = *t - *session_epoch;
+    auto half = std::chrono::duration_cast<rtcp::ntp_time>(media::timestamp(1)) / 2;
+    return std::chrono::duration_cast<media::timestamp>(d < d.zero() ? d - half : d + half);
+  }
+
+  // wall clock time of the sender at which the packet was sampled
+  utils::optional<std::chrono::system_clock::time_point> wall_clock(rtp_packet const& p) {
+    auto t = sample_time(p);
+    if(!t) return utils::nullopt;
+    return rtcp::to_system_time(*t);
+  }
+
+  // wall clock time of the sender at session time zero
+  utils::optional<std::chrono::system_clock::time_point> epoch() const {
+    if(!session_epoch) return utils::nullopt;
+    return rtcp::to_system_time(*session_epoch);
+  }
+
+private:
+  struct stream {
+    std::uint32_t ssrc;
+    std::uint32_t clock_rate;
+    timestamp_unwrapper unwrap{};
+    utils::optional<std::int64_t> reference{};
+    rtcp::ntp_time reference_time{0};
+  };
+
+  stream* find(std::uint32_t ssrc) {
+    auto i = std::find_if(streams.begin(), streams.end(), [=](stream const& s) { return s.ssrc == ssrc; });
+    return i != streams.end() ? &*i : nullptr;
+  }
+
+  utils::optional<rtcp::ntp_time> sample_time(rtp_packet const& p) {
+    if(p.empty()) return utils::nullopt;
+
+    auto s = find(p.ssrc());
+    if(!s) return utils::nullopt;
+
+    auto ts = s->unwrap(p.timestamp());
+    if(!s->reference) return utils::nullopt;
+
+    auto ticks = ts - *s->reference;
+    std::int64_t rate = s->clock_rate;
+    return s->reference_time + rtcp::ntp_time(ticks / rate * 1000000000 + (ticks % rate * 1000000000 + rate / 2) / rate);
+  }
+
+  std::vector<stream> streams;
+  utils::optional<rtcp::ntp_time> session_epoch;
+};
+
 // rfc2250
 struct mpeg_video_header {
   net32_t value;
@@ -167,7 +888,7 @@ struct mpeg_video_header {
 
   bool extension_header_present() const { return t(); }
   unsigned temporal_reference() const { return tr(); }
-  mpeg::picture_coding picture_coding_type() const { return mpeg::picture_coding(p()); }
+  media::mpeg::picture_coding picture_coding_type() const { return media::mpeg::picture_coding(p()); }
   bool new_picture_header() const { return an() & n(); }
   bool sequence_header_present() const { return s(); }
   bool beginning_of_slice() const { return s(); }
@@ -240,11 +961,12 @@ struct m2v_packet : rtp_packet {
   }
 
   std::uint16_t temporal_reference() const { return video_header().tr(); }
-  mpeg::picture_coding picture_coding_type() const { return video_header().picture_coding_type(); }
+  media::mpeg::picture_coding picture_coding_type() const { return video_header().picture_coding_type(); }
   bool has_beginning_of_slice() const { return video_header().b(); }
   bool has_end_of_slice() const { return video_header().e(); }
 }; 
 
+inline
 std::ostream& operator << (std::ostream& os, m2v_packet const& p) {
   return os << "m2v_packet{tr:" << p.temporal_reference() << ", seq:" << p.sequence_number() << ", t:" << p.video_extension_header_present() << 
     ", an:" << p.video_header().an() << ", n:" << p.video_header().n() << 
@@ -252,54 +974,699 @@ std::ostream& operator << (std::ostream& os, m2v_packet const& p) {
     << "}";
 }
 
+// Assembles rfc2250 packets into access units. Packets are expected in sequence order
+// (e.g. released by rtp::jitter_buffer); a picture interrupted by a sequence gap is dropped
+// and assembly resumes at the next packet that starts with a sequence, gop or picture header.
+// A picture is complete when its packet carrying the marker bit arrives, or when a packet
+// with another temporal_reference begins a new one. Packets are held in a ring of N slots
+// and every completed access unit is returned as a scatter-gather view over their payloads
+// which stays valid until the next call.
+template<std::size_t N = 1024>
 struct m2v_au_assembler {
+  static_assert(N && (N & (N - 1)) == 0 && N <= 0x8000, "m2v_au_assembler capacity must be a power of two not above 2^15");
+
+  using iterator = bitstream::asio_sequence_iterator<asio::const_buffer const*>;
+
   struct access_unit {
-    std::vector<m2v_packet> packets;
-  
-    std::uint16_t temporal_reference() const { return packets.front().temporal_reference(); }
+    video_timestamp_t timestamp;
+    std::uint16_t temporal_reference;
+    media::mpeg::picture_coding picture_coding_type;
+    utils::range<iterator> data;
+  };
 
-    std::uint16_t min_seq() const { return packets.front().sequence_number(); }
-    std::uint16_t max_seq() const { return packets.back().sequence_number(); }
-  
-    void push(m2v_packet&& p) {
-      auto pos = std::int32_t(p.sequence_number() - min_seq());
-      if(pos < 0) {
-        packets.insert(packets.begin(), -pos, m2v_packet());
-        packets.front() = std::move(p);
+  struct statistics {
+    std::uint64_t pictures = 0;
+    std::uint64_t dropped = 0;    // pictures lost to a sequence gap or overflow
+    std::uint64_t truncated = 0;  // pictures whose last packet had no end-of-slice bit
+    std::uint64_t late = 0;
+  };
+
+  utils::optional<access_unit> operator()(m2v_packet p) {
+    release();
+
+    if(p.empty()) return utils::nullopt;
+
+    std::uint16_t seq = p.sequence_number();
+    utils::optional<access_unit> r;
+
+    if(count) {
+      if(sequence_number_compare(seq, next)) {
+        ++counters.late;
+        return utils::nullopt;
       }
-      else if(pos >= packets.size()) {
-        packets.resize(pos+1);
-        packets[pos] = std::move(p);
+
+      if(seq != next) {
+        ++counters.dropped;
+        discard();
       }
-      else {
-        packets[pos] = std::move(p);
+      else if(p.temporal_reference() != temporal_reference) {
+        if(!last().has_end_of_slice()) ++counters.truncated;
+        r = emit();
       }
     }
+
+    if(!count && !starts_access_unit(p)) return r;
+
+    if(count == N) {
+      ++counters.dropped;
+      discard();
+      return r;
+    }
+
+    if(!count) {
+      first = seq;
+      temporal_reference = p.temporal_reference();
+    }
+
+    auto n = std::size_t(p.end() - p.begin());
+    if(n) buffers[current][size++] = asio::const_buffer(p.begin(), n);
+
+    slot(seq) = std::move(p);
+    next = seq + 1;
+    ++count;
+
+    if(!r && last().m()) r = emit();
+    return r;
+  }
+
+  // emits the picture being assembled, e.g. at the end of the stream
+  utils::optional<access_unit> flush() {
+    release();
+    if(!count) return utils::nullopt;
+    return emit();
+  }
+
+  friend statistics const& stats(m2v_au_assembler const& a) { return a.counters; }
+
+private:
+  static bool starts_access_unit(m2v_packet const& p) {
+    if(!p.has_beginning_of_slice() || p.end() - p.begin() < 4) return false;
+    auto i = p.begin();
+    return i[0] == 0 && i[1] == 0 && i[2] == 1 &&
+      (i[3] == media::mpeg::sequence_header_code || i[3] == media::mpeg::group_start_code || i[3] == media::mpeg::picture_start_code);
+  }
+
+  m2v_packet& slot(std::uint16_t seq) { return packets[seq % N]; }
+  m2v_packet const& last() const { return packets[std::uint16_t(next - 1) % N]; }
+
+  access_unit emit() {
+    auto const& f = packets[first % N];
+    access_unit au{f.timestamp(), temporal_reference, f.picture_coding_type(),
+      {iterator(buffers[current].data()), iterator(buffers[current].data() + size)}};
+
+    ++counters.pictures;
+    emitted_first = first;
+    emitted_count = count;
+    
+    current ^= 1;
+    count = size = 0;
+
+    return au;
+  }
+
+  void discard() {
+    for(std::size_t i = 0; i != count; ++i) slot(first + i) = m2v_packet();
+    count = size = 0;
+  }
+
+  void release() {
+    for(std::size_t i = 0; i != emitted_count; ++i) slot(emitted_first + i) = m2v_packet();
+    emitted_count = 0;
+  }
+
+  std::array<m2v_packet, N> packets;
+  std::array<asio::const_buffer, N> buffers[2];
+  unsigned current = 0;
+
+  std::uint16_t first = 0;
+  std::uint16_t next = 0;
+  std::uint16_t temporal_reference = 0;
+  std::size_t count = 0;
+  std::size_t size = 0;
+
+  std::uint16_t emitted_first = 0;
+  std::size_t emitted_count = 0;
+
+  statistics counters;
+};
+
+// Presents the transport stream packets carried in rfc2250 mp2t payloads (pt 33) as
+// ts::packet ranges, a Source for ts::demuxer in place of ts::buffered_reader. source()
+// returns the next rtp_packet in sequence order (e.g. released by rtp::jitter_buffer) and
+// an empty one at the end of the stream. A returned ts packet points into the rtp packet
+// it came with and stays valid until that packet is exhausted.
+template<typename Source>
+struct mp2t_reader {
+  mp2t_reader(Source source) : source(std::move(source)) {}
+
+  Source source;
+  rtp_packet current;
+  std::uint8_t const* pos = nullptr;
+  std::uint8_t const* last = nullptr;
+
+  media::mpeg::ts::packet<utils::range<std::uint8_t const*>> operator()() {
+    using namespace media::mpeg;
+
+    while(pos == last) {
+      current = source();
+      if(current.empty()) {
+        pos = last = nullptr;
+        return utils::tag<ts::packet_tag>(utils::range<std::uint8_t const*>{nullptr, nullptr});
+      }
+
+      pos = current.begin();
+      last = current.end();
+      if((last - pos) % ts::packet_length) {
+        pos = last;
+        throw std::system_error(ts::make_error_code(ts::errc::framing_error));
+      }
+    }
+
+    auto p = pos;
+    pos += ts::packet_length;
+
+    return utils::tag<ts::packet_tag>(utils::range<std::uint8_t const*>{p, pos});
+  }
+};
+
+template<typename Source, typename... Pids>
+media::mpeg::ts::demuxer<mp2t_reader<Source>, sizeof...(Pids)> make_mp2t_demuxer(Source src, Pids... pids) {
+  unsigned a[] = {pids...};
+  return media::mpeg::ts::demuxer<mp2t_reader<Source>, sizeof...(Pids)>(std::move(src), a);
+}
+
+// smpte 2022-1 fec header, follows the rtp header of column and row fec packets
+struct fec_header {
+  net32_t storage[4];
+
+  unsigned  sn_base_low_bits() const { return get( 0.16_bf, storage[0]); }
+  unsigned  length_recovery()  const { return get(16.16_bf, storage[0]); }
+  bool      e()                const { return get( 0.1_bf,  storage[1]); }
+  unsigned  pt_recovery()      const { return get( 1.7_bf,  storage[1]); }
+  unsigned  mask()             const { return get( 8.24_bf, storage[1]); }
+  std::uint32_t ts_recovery()  const { return get( 0.32_bf, storage[2]); }
+  bool      x()                const { return get( 0.1_bf,  storage[3]); }
+  bool      d()                const { return get( 1.1_bf,  storage[3]); }
+  unsigned  type()             const { return get( 2.3_bf,  storage[3]); }
+  unsigned  index()            const { return get( 5.3_bf,  storage[3]); }
+  unsigned  offset()           const { return get( 8.8_bf,  storage[3]); }
+  unsigned  na()               const { return get(16.8_bf,  storage[3]); }
+  unsigned  sn_base_ext_bits() const { return get(24.8_bf,  storage[3]); }
+
+  std::uint16_t sn_base() const { return sn_base_low_bits(); }
+  bool row() const { return d(); }
+};
+
+struct fec_packet : rtp_packet {
+  fec_packet() = default;
+  
+  fec_packet(fec_packet&&) = default;
+  fec_packet& operator=(fec_packet&&) = default;
+  
+  fec_packet(fec_packet const&) = default;
+  fec_packet& operator=(fec_packet const&) = default;
+
+  // only the xor scheme of smpte 2022-1 is accepted
+  static fec_packet parse(rtp_packet&& rtp) {
+    if(rtp.empty() || std::size_t(rtp.end() - rtp.begin()) < sizeof(fec_header)) return fec_packet();
+
+    auto& h = *reinterpret_cast<fec_header const*>(rtp.begin());
+    if(h.x() || h.type() != 0 || h.na() == 0 || h.offset() == 0)
+      return fec_packet();
+
+    fec_packet r;
+    static_cast<rtp_packet&>(r) = std::move(rtp);
+    return r;
+  }
+
+  fec_header const& fec() const { return *reinterpret_cast<fec_header const*>(rtp_packet::begin()); }
+
+  // rfc2733 carries the recovery of the marker bits in the marker of the fec rtp header
+  bool m_recovery() const { return m(); }
+
+  std::uint8_t const* begin() const { return rtp_packet::begin() + sizeof(fec_header); }
+  std::uint8_t const* end() const { return rtp_packet::end(); }
+
+  // sequence number of the i-th protected media packet
+  std::uint16_t protected_sequence_number(unsigned i) const { return fec().sn_base() + i * fec().offset(); }
+
+  bool protects(std::uint16_t seq) const {
+    std::uint16_t d = seq - fec().sn_base();
+    return d % fec().offset() == 0 && d / fec().offset() < fec().na();
+  }
+};
+
+namespace detail {
+
+inline
+void xor_bytes(std::uint8_t* dst, std::uint8_t const* src, std::size_t n) {
+  using v16 = std::uint8_t __attribute__((vector_size(16)));
+
+  for(; n >= 4*sizeof(v16); n -= 4*sizeof(v16), dst += 4*sizeof(v16), src += 4*sizeof(v16)) {
+    v16 a[4], b[4];
+    std::memcpy(a, dst, sizeof(a));
+    std::memcpy(b, src, sizeof(b));
+    for(int i = 0; i != 4; ++i) a[i] ^= b[i];
+    std::memcpy(dst, a, sizeof(a));
+  }
+
+  for(; n; --n) *dst++ ^= *src++;
+}
+
+}
+
+// Recovers media packets lost from a smpte 2022-1 (rfc2733 xor) protected stream using its
+// column and row fec streams. Media packets are pushed as they arrive and kept in a ring of
+// the last N sequence numbers; a fec packet recovers the one media packet it protects that
+// is missing, recovered packets in turn may complete other fec packets. Fec packets still
+// missing more than one media packet wait until their media leaves the window, at most M
+// of them. Recovered packets are queued, at most M of them, until taken with pop() and are
+// to be inserted with jitter_buffer::repair(), their arrival time says nothing about the
+// network jitter. Media packets are assumed to carry no csrc list, header extension or
+// padding, as 2022-1 requires.
+template<std::size_t N = 1024, std::size_t M = 64>
+struct fec_decoder {
+  static_assert(N && (N & (N - 1)) == 0 && N <= 0x8000, "fec_decoder window must be a power of two not above 2^15");
+
+  struct statistics {
+    std::uint64_t recovered = 0;
+    std::uint64_t unrecoverable = 0;  // fec packets that left the window with several media packets missing
+    std::uint64_t malformed = 0;      // fec packets inconsistent with the media they protect
+    std::uint64_t overflows = 0;      // fec or recovered packets dropped because the queues were full
   };
 
-  std::vector<access_unit> units;
+  void push(rtp_packet p) {
+    if(p.empty()) return;
+    
+    std::uint16_t seq = p.sequence_number();
+    
+    if(!started || sequence_number_compare(highest, seq)) {
+      started = true;
+      highest = seq;
+    }
+    else if(std::uint16_t(highest - seq) >= N) 
+      return;
 
-  void operator()(m2v_packet p) {
-    auto i = std::lower_bound(units.begin(), units.end(), p.sequence_number(),
-      utils::make_compare_by_key([](access_unit const& a) { return a.min_seq(); }, sequence_number_compare));
+    slot(seq) = std::move(p);
+    
+    if(pending_count) {
+      expire();
+      retry(seq);
+    }
+  }
 
-    if(i != units.begin() && (i-1)->temporal_reference() == p.temporal_reference())
-      --i;
+  void push(fec_packet f) {
+    if(f.empty() || !started) return;
+    
+    auto last = f.protected_sequence_number(f.fec().na() - 1);
+    if(std::uint16_t(highest - last) >= N && !sequence_number_compare(highest, last)) return;
 
-    if(i == units.end() || i->temporal_reference() != p.temporal_reference()) {
-      std::cout << "new_access_unit:" << p << std::endl; 
-      i = units.insert(i, {{std::move(p)}});
+    if(!try_recover(f)) {
+      if(pending_count == M) {
+        ++counters.overflows;
+        return;
+      }
+      pending[pending_count++] = std::move(f);
     }
-    else {
-      i->push(std::move(p));
+  }
+
+  // next recovered packet, an empty one if there is none
+  rtp_packet pop() {
+    if(!out_count) return rtp_packet();
+    --out_count;
+    return std::move(out[out_first++ % M]);
+  }
+
+  friend statistics const& stats(fec_decoder const& d) { return d.counters; }
+
+private:
+  rtp_packet& slot(std::uint16_t seq) { return media[seq % N]; }
+
+  bool present(std::uint16_t seq) {
+    auto& p = slot(seq);
+    return !p.empty() && p.sequence_number() == seq && std::uint16_t(highest - seq) < N;
+  }
+
+  // true if the fec packet is done with, i.e. nothing is missing or the missing packet is recovered
+  bool try_recover(fec_packet const& f) {
+    auto const& h = f.fec();
+
+    unsigned missing = 0;
+    std::uint16_t seq = 0;
+    for(unsigned i = 0; i != h.na() && missing < 2; ++i) {
+      auto s = f.protected_sequence_number(i);
+      if(!present(s)) {
+        ++missing;
+        seq = s;
+      }
+    }
+
+    if(missing == 0) return true;
+    if(missing > 1) return false;
+
+    auto r = recover(f, seq);
+    if(r.empty()) {
+      ++counters.malformed;
+      return true;
+    }
+
+    ++counters.recovered;
+    slot(seq) = r;
+    if(out_count == M) {
+      ++counters.overflows;
+      --out_count;
+      ++out_first;
+    }
+    out[(out_first + out_count++) % M] = std::move(r);
+
+    retry(seq);
+    return true;
+  }
+
+  rtp_packet recover(fec_packet const& f, std::uint16_t seq) {
+    auto const& h = f.fec();
+    std::size_t n = f.end() - f.begin();
+    if(n > udp_packet::max_size() - sizeof(rtp_header)) return rtp_packet();
+
+    udp_packet u;
+    u.resize(sizeof(rtp_header) + n);
+    auto d = u.begin();
+
+    std::memcpy(d + sizeof(rtp_header), f.begin(), n);
+    
+    std::size_t length = h.length_recovery();
+    unsigned pt = h.pt_recovery();
+    bool marker = f.m_recovery();
+    std::uint32_t ts = h.ts_recovery();
+    std::uint32_t ssrc = 0;
+
+    for(unsigned i = 0; i != h.na(); ++i) {
+      auto s = f.protected_sequence_number(i);
+      if(s == seq) continue;
+
+      auto const& p = slot(s);
+      auto payload = p.udp_packet::begin() + sizeof(rtp_header);
+      std::size_t m = p.udp_packet::end() - payload;
+      if(m > n) return rtp_packet();
+
+      detail::xor_bytes(d + sizeof(rtp_header), payload, m);
+      length ^= m;
+      pt ^= p.pt();
+      marker ^= p.m();
+      ts ^= p.timestamp();
+      ssrc = p.ssrc();
+    }
+
+    if(length > n) return rtp_packet();
+
+    std::uint8_t header[sizeof(rtp_header)] = {
+      0x80, std::uint8_t((marker ? 0x80 : 0) | (pt & 0x7f)), std::uint8_t(seq >> 8), std::uint8_t(seq),
+      std::uint8_t(ts >> 24), std::uint8_t(ts >> 16), std::uint8_t(ts >> 8), std::uint8_t(ts),
+      std::uint8_t(ssrc >> 24), std::uint8_t(ssrc >> 16), std::uint8_t(ssrc >> 8), std::uint8_t(ssrc)
+    };
+    std::memcpy(d, header, sizeof(header));
+
+    u.resize(sizeof(rtp_header) + length);
+    return rtp_packet::parse(std::move(u));
+  }
+
+  // gives pending fec packets protecting seq another chance
+  void retry(std::uint16_t seq) {
+    for(std::size_t i = 0; i < pending_count;) {
+      if(!pending[i].protects(seq)) {
+        ++i;
+        continue;
+      }
+
+      auto f = std::move(pending[i]);
+      if(i != --pending_count) pending[i] = std::move(pending[pending_count]);
+
+      // a recovery may have changed the pending set, start over
+      if(try_recover(f)) {
+        i = 0;
+        continue;
+      }
+
+      if(i != pending_count) pending[pending_count] = std::move(pending[i]);
+      ++pending_count;
+      pending[i++] = std::move(f);
+    }
+  }
+
+  void expire() {
+    for(std::size_t i = 0; i < pending_count;) {
+      auto first = pending[i].protected_sequence_number(0);
+      if(std::uint16_t(highest - first) >= N && !sequence_number_compare(highest, first)) {
+        ++counters.unrecoverable;
+        pending[i] = std::move(pending[--pending_count]);
+      }
+      else
+        ++i;
     }
   }
+
+  std::array<rtp_packet, N> media;
+  std::array<fec_packet, M> pending;
+  std::size_t pending_count = 0;
+
+  std::array<rtp_packet, M> out;
+  std::size_t out_first = 0;
+  std::size_t out_count = 0;
+
+  bool started = false;
+  std::uint16_t highest = 0;
+
+  statistics counters;
+};
+
+// Storage for nal units reassembled from fu-a fragments. Buffers keep their capacity when
+// they return to the free list, so once warmed up reassembly does not allocate.
+class fragment_pool {
+public:
+  struct buffer {
+    std::vector<std::uint8_t> data;
+    std::size_t refs = 0;
+    fragment_pool* pool = nullptr;
+    buffer* next_free = nullptr;
+
+    friend void intrusive_ptr_add_ref(buffer* b) { ++b->refs; }
+    friend void intrusive_ptr_release(buffer* b) {
+      if(--b->refs == 0) b->pool->recycle(b);
+    }
+  };
+
+  fragment_pool() = default;
+  fragment_pool(fragment_pool const&) = delete;
+  fragment_pool& operator=(fragment_pool const&) = delete;
+
+  utils::intrusive_ptr<buffer> allocate() {
+    if(!free_list) {
+      buffers.emplace_back(new buffer);
+      buffers.back()->pool = this;
+      recycle(buffers.back().get());
+    }
+    auto b = free_list;
+    free_list = b->next_free;
+    b->data.clear();
+    return utils::intrusive_ptr<buffer>(b);
+  }
+
+  static fragment_pool& default_pool() {
+    static fragment_pool pool;
+    return pool;
+  }
+
+private:
+  friend void intrusive_ptr_release(buffer*);
+
+  void recycle(buffer* b) {
+    b->next_free = free_list;
+    free_list = b;
+  }
+
+  std::vector<std::unique_ptr<buffer>> buffers;
+  buffer* free_list = nullptr;
+};
+
+// Bytes of an h264 rtp payload: either a range of the received packet, which it keeps
+// alive, or a nal unit reassembled into a fragment_pool buffer.
+class h264_payload {
+  udp_packet packet;
+  utils::intrusive_ptr<fragment_pool::buffer> fragments;
+  std::uint8_t const* first = nullptr;
+  std::uint8_t const* last = nullptr;
+public:
+  h264_payload() = default;
+  h264_payload(udp_packet p, std::uint8_t const* first, std::uint8_t const* last) : 
+    packet(std::move(p)), first(first), last(last) {}
+  explicit h264_payload(utils::intrusive_ptr<fragment_pool::buffer> b) : 
+    fragments(std::move(b)), first(fragments->data.data()), last(first + fragments->data.size()) {}
+
+  friend std::uint8_t const* begin(h264_payload const& p) { return p.first; }
+  friend std::uint8_t const* end(h264_payload const& p) { return p.last; }
+  friend bool empty(h264_payload const& p) { return p.first == p.last; }
+
+  friend std::pair<h264_payload, h264_payload> split(h264_payload p, std::uint8_t const* i) {
+    auto head = p;
+    head.last = i;
+    p.first = i;
+    return std::make_pair(std::move(head), std::move(p));
+  }
+
+  friend asio::const_buffers_1 as_asio_sequence(h264_payload const& p) {
+    return asio::const_buffers_1(p.first, p.last - p.first);
+  }
 };
 
-struct h264_packet : rtp_packet {};
+// Depacketizes rfc6184 non-interleaved mode streams: single nal unit, stap-a and fu-a
+// packets. Packets are expected in sequence order (e.g. released by rtp::jitter_buffer).
+// Single nal units and stap-a aggregates are passed on as ranges of their packets, fu-a
+// fragments are appended into a fragment_pool buffer. An access unit ends with the packet
+// carrying the marker bit or when a packet with another timestamp arrives. A nal unit
+// interrupted by a sequence gap is dropped and the access unit is reported incomplete.
+struct h264_depacketizer {
+  using nal_unit = media::h264::nal_unit<h264_payload>;
+
+  struct access_unit {
+    video_timestamp_t timestamp;
+    bool complete;
+    std::vector<nal_unit> nal_units;
+  };
+
+  struct statistics {
+    std::uint64_t access_units = 0;
+    std::uint64_t nal_units = 0;
+    std::uint64_t dropped = 0;    // nal units lost with a fragment
+    std::uint64_t malformed = 0;  // packets with a truncated or unsupported payload
+    std::uint64_t late = 0;
+  };
+
+  explicit h264_depacketizer(fragment_pool& pool = fragment_pool::default_pool()) : pool(&pool) {}
+
+  utils::optional<access_unit> operator()(rtp_packet p) {
+    if(p.empty()) return utils::nullopt;
+
+    std::uint16_t seq = p.sequence_number();
+    utils::optional<access_unit> r;
+
+    if(started && sequence_number_compare(seq, next)) {
+      ++counters.late;
+      return utils::nullopt;
+    }
+
+    // after a gap neither the access unit in progress nor the next one is known to be whole
+    bool gap = started && seq != next;
+    if(gap) {
+      complete = false;
+      drop_fragment();
+    }
+
+    if(pending && p.timestamp() != timestamp) r = emit();
+    if(gap) complete = false;
+
+    started = pending = true;
+    next = seq + 1;
+    timestamp = p.timestamp();
+    
+    auto marker = p.m();
+    depacketize(std::move(p));
+
+    if(!r && marker) r = emit();
+    return r;
+  }
+
+  // emits the access unit being assembled, e.g. at the end of the stream
+  utils::optional<access_unit> flush() {
+    if(!pending) return utils::nullopt;
+    return emit();
+  }
+
+  friend statistics const& stats(h264_depacketizer const& d) { return d.counters; }
+
+private:
+  enum : unsigned { stap_a = 24, fu_a = 28 };
+
+  void depacketize(rtp_packet p) {
+    auto i = p.begin();
+    auto e = p.end();
+
+    if(i == e) return;
+
+    auto type = *i & 0x1f;
+
+    if(type > 0 && type < 24) {
+      drop_fragment();
+      add(h264_payload(std::move(p), i, e));
+    }
+    else if(type == stap_a) {
+      drop_fragment();
+      for(++i; e - i >= 2;) {
+        std::size_t n = (i[0] << 8) | i[1];
+        i += 2;
+        if(!n || n > std::size_t(e - i)) break;
+        add(h264_payload(p, i, i + n));
+        i += n;
+      }
+      if(i != e) ++counters.malformed;
+    }
+    else if(type == fu_a && e - i > 2) {
+      bool s = i[1] & 0x80;
+      bool end = i[1] & 0x40;
+
+      if(s) {
+        drop_fragment();
+        fragment = pool->allocate();
+        fragment->data.push_back((i[0] & 0xe0) | (i[1] & 0x1f));
+      }
+      else if(!fragment) 
+        return;
+      
+      fragment->data.insert(fragment->data.end(), i + 2, e);
+
+      if(end) add(h264_payload(std::move(fragment)));
+    }
+    else
+      ++counters.malformed;
+  }
+
+  void add(h264_payload p) {
+    ++counters.nal_units;
+    nal_units.push_back(utils::tag<media::h264::nal_unit_tag>(std::move(p)));
+  }
+
+  void drop_fragment() {
+    if(!fragment) return;
+    ++counters.dropped;
+    complete = false;
+    fragment = {};
+  }
+
+  utils::optional<access_unit> emit() {
+    drop_fragment();
+    pending = false;
+
+    utils::optional<access_unit> r;
+    if(!nal_units.empty()) {
+      ++counters.access_units;
+      r = access_unit{video_timestamp_t(timestamp), complete, std::move(nal_units)};
+    }
+
+    nal_units.clear();
+    complete = true;
+    return r;
+  }
+
+  fragment_pool* pool;
+  utils::intrusive_ptr<fragment_pool::buffer> fragment;
+  std::vector<nal_unit> nal_units;
+
+  bool started = false;
+  bool pending = false;
+  bool complete = true;
+  std::uint16_t next = 0;
+  std::uint32_t timestamp = 0;
 
-struct h264_defragmenter {
-  using nalu = std::vector<h264_packet>;
+  statistics counters;
 };
 
 
@@ -0,0 +1,87 @@
+// Decodes long runs of pictures into the fixed slots of decoded_picture_buffer with
+// max_num_ref_frames = 16 and outputs them by C.4.5.3 bumping. Pictures are marked and stored
+// once they are decoded as h264::decoder does, or marked with the first slice of the next
+// picture as h264::context does on its own.
+
+#include "../h264-context.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+using namespace media::h264;
+
+struct stream {
+  std::size_t dpb_size;
+  std::size_t reorder_window;
+  // every period-th picture is a reference picture, the others are not
+  unsigned period;
+  bool deferred_marking;
+};
+
+// returns the number of frames output, all in poc order
+std::size_t decode(stream const& s, unsigned pictures) {
+  decoded_picture_buffer<int> dpb;
+  dec_ref_pic_marker marking;
+  std::vector<std::pair<int, std::size_t>> reorder;
+  std::size_t output = 0;
+  int last = -1;
+
+  auto bump = [&](std::size_t window, std::size_t size) {
+    while(!reorder.empty() && (reorder.size() > window || dpb.size() > size)) {
+      std::pop_heap(reorder.begin(), reorder.end(), std::greater<>());
+      assert(reorder.back().first > last);
+      last = reorder.back().first;
+      mark_as_not_needed_for_output(dpb[reorder.back().second]);
+      reorder.pop_back();
+      dpb.remove_unused_pictures();
+      ++output;
+    }
+  };
+
+  for(unsigned i = 0; i != pictures; ++i) {
+    auto curr = dpb.current_picture();
+    if(curr && s.deferred_marking) marking(*curr, dpb.begin(), dpb.end());
+
+    // pictures come in groups of period with the reference picture first in decoding order
+    // and last in output order
+    auto poc = int(i - i % s.period + (i % s.period ? i % s.period - 1 : s.period - 1)) * 2;
+    dpb.new_picture(i == 0, picture_type::frame, i % 256, false, poc_t{poc, poc});
+
+    marking.max_frame_num = 256;
+    marking.max_num_ref_frames = 16;
+    marking.nal_ref_idc = i % s.period == 0;
+    marking.IdrPicFlag = i == 0;
+    marking.long_term_reference_flag = false;
+
+    curr = dpb.current_picture();
+    if(!s.deferred_marking) {
+      marking(*curr, dpb.begin(), dpb.end());
+      dpb.store_current_picture();
+    }
+
+    reorder.emplace_back(poc, std::size_t(&*curr->frame - dpb.begin()));
+    std::push_heap(reorder.begin(), reorder.end(), std::greater<>());
+
+    dpb.remove_unused_pictures();
+    bump(s.reorder_window, s.dpb_size);
+  }
+
+  bump(0, 0);
+  return output;
+}
+
+int main() {
+  // all pictures are references, output at once or held for the largest reorder window
+  assert(decode(stream{16, 0, 1, false}, 200) == 200);
+  assert(decode(stream{16, 16, 1, false}, 200) == 200);
+
+  // 16 reference frames with non-reference pictures between them
+  assert(decode(stream{16, 16, 3, false}, 200) == 200);
+  assert(decode(stream{16, 2, 3, false}, 200) == 200);
+
+  // the frame unmarked with the next picture makes room for it
+  assert(decode(stream{17, 0, 1, true}, 200) == 200);
+
+  std::cout << "ok" << std::endl;
+}
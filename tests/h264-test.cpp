@@ -79,35 +79,6 @@ buffered_stream<Stream, Buffer> make_buffered_stream(Stream stream, Buffer buffe
   return buffered_stream<Stream, Buffer>{stream, std::move(buffer)};
 }
 
-std::size_t max_dec_frame_buffering(media::h264::seq_parameter_set const& s) {
-  static const std::initializer_list<std::pair<unsigned, unsigned>> max_dpb_mbs_map = {
-    {10, 396},
-    {11, 900},
-    {12, 2376},
-    {13, 2376},
-    {20, 2376},
-    {21, 4752},
-    {22, 8100},
-    {30, 8100},
-    {31, 18000},
-    {32, 20480},
-    {40, 32768},
-    {41, 32768},
-    {42, 34816},
-    {50, 110400},
-    {51, 184320},
-    {52, 184320}
-  };
-
-  auto i = std::find_if(max_dpb_mbs_map.begin(), max_dpb_mbs_map.end(), [&](std::pair<unsigned, unsigned> const& a) { return a.first == s.level_idc; });
-  if(i == max_dpb_mbs_map.end()) throw std::runtime_error("unsupported level");
-
-  auto pic_in_mbs = (s.pic_width_in_mbs_minus1 + 1)*(s.pic_height_in_map_units_minus1 + 1)*(s.frame_mbs_only_flag ? 1 : 2);
-
-  return std::min(i->second/pic_in_mbs, 16u);
-}
-
-
 struct display_order_output {
   mvdu::handle device;
 
@@ -116,32 +87,32 @@ struct display_order_output {
   friend void on_new_picture(display_order_output& output, media::h264::context<buffer_type>& dpb) {
     using value_type = media::h264::decoded_picture_buffer<buffer_type>::value_type;
 
-    
-    if(dpb.slice().IdrPicFlag || has_mmco5(dpb.slice())) {
-      std::sort(dpb.begin(), dpb.current_picture()->frame, [](value_type const& a, value_type const& b) { return PicOrderCnt(a) < PicOrderCnt(b); });
+    // frame needed for output with the lowest poc, not the current one
+    auto next_output = [&] {
+      return std::min_element(dpb.begin(), dpb.end(),
+        [&](value_type const& a, value_type const& b) {
+          return std::make_tuple(!is_needed_for_output(a) || &a == &*dpb.current_picture()->frame, PicOrderCnt(a)) 
+               < std::make_tuple(!is_needed_for_output(b) || &b == &*dpb.current_picture()->frame, PicOrderCnt(b)); 
+      });
+    };
 
-      for(auto i = dpb.begin(), e = dpb.current_picture()->frame; i != e; ++i) {
-        async_render(output.device, frame_buffer(*i), [](std::error_code const& ec, buffer_type buffer) {});
-        mark_as_not_needed_for_output(*i);
-      }
-      dpb.erase(dpb.begin(), dpb.current_picture()->frame);
+    auto render = [&](value_type& f) {
+      assert(is_needed_for_output(f));
+      async_render(output.device, frame_buffer(f), [](std::error_code const& ec, buffer_type buffer) {});
+      mark_as_not_needed_for_output(f);
+    };
+
+    if(dpb.slice().IdrPicFlag || has_mmco5(dpb.slice())) {
+      for(auto i = next_output(); i != dpb.end() && is_needed_for_output(*i) && i != dpb.current_picture()->frame; i = next_output())
+        render(*i);
     }
   
-    dpb.erase(remove_unused_pictures(dpb.begin(), dpb.end()), dpb.end());
+    dpb.remove_unused_pictures();
 
     auto fullness = std::count_if(dpb.begin(), dpb.end(), [](value_type const& v) { return is_needed_for_output(v); });
 
-    if(fullness > max_dec_frame_buffering(dpb.sps())+1) {
-      auto i = std::min_element(dpb.begin(), dpb.current_picture()->frame,
-        [&](value_type const& a, value_type const& b) {
-          return std::make_tuple(!is_needed_for_output(a), PicOrderCnt(a)) 
-               < std::make_tuple(!is_needed_for_output(b), PicOrderCnt(b)); 
-      });
-
-      assert(is_needed_for_output(*i));
-      async_render(output.device, frame_buffer(*i), [](std::error_code const& ec, buffer_type buffer) {});
-      mark_as_not_needed_for_output(*i);
-    }
+    if(fullness > max_dec_frame_buffering(dpb.sps())+1)
+      render(*next_output());
   }
 
   template<typename Callback>
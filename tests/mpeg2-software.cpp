@@ -0,0 +1,125 @@
+// Decodes an mpeg-1/2 elementary stream with mpeg::decoder on the software msvd backend and
+// reports the decoding throughput, no msvd device is needed.
+//
+//   mpeg2-software stream.m2v [threads] [repeat]
+
+#include "../mpeg.hpp"
+#include "../mpeg-decoder.hpp"
+#include "../msvd-software.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <thread>
+
+// frame buffer in host memory with the mvdu layout of video::sink buffers
+struct host_buffer {
+  std::shared_ptr<std::vector<std::uint8_t>> data;
+
+  explicit operator bool() const { return bool(data); }
+};
+
+namespace media { namespace msvd {
+template<> struct buffer_traits<host_buffer> {
+  static constexpr std::uint32_t width = 1920;
+  static constexpr std::uint32_t height = 1088;
+  static constexpr std::uint32_t luma_offset = 0;
+  static constexpr std::uint32_t chroma_offset = width * height;
+};
+}}
+
+unsigned long phys_addr(host_buffer const& b) { return reinterpret_cast<unsigned long>(b.data->data()); }
+void* luma_buffer(host_buffer const& b) { return b.data->data(); }
+void* chroma_buffer(host_buffer const& b) { return b.data->data() + media::msvd::buffer_traits<host_buffer>::chroma_offset; }
+
+// buffers still referenced by a picture in flight or by the reference list are not reused
+struct buffer_pool {
+  std::vector<host_buffer> buffers;
+
+  host_buffer pull() {
+    for(auto& b: buffers)
+      if(b.data.use_count() == 1) return b;
+
+    buffers.push_back(host_buffer{std::make_shared<std::vector<std::uint8_t>>(
+      media::msvd::buffer_traits<host_buffer>::chroma_offset * 3 / 2)});
+    return buffers.back();
+  }
+};
+
+// the decoder keeps copies of its frame source and sink, so both refer to the state of main()
+struct frame_source {
+  buffer_pool* pool;
+
+  friend utils::shared_future<host_buffer> pull(frame_source& s) { return utils::make_ready_future(s.pool->pull()).share(); }
+};
+
+struct frame_sink {
+  std::uint64_t* frames;
+
+  friend void set_dimensions(frame_sink&, media::video::resolution, media::video::aspect_ratio) {}
+  friend void push(frame_sink& s, media::timestamp, utils::shared_future<host_buffer>) { ++*s.frames; }
+};
+
+using namespace media;
+using clock_type = std::chrono::steady_clock;
+
+int main(int argc, char* argv[]) {
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0] << " stream.m2v [threads] [repeat]" << std::endl;
+    return 1;
+  }
+
+  std::ifstream in(argv[1], std::ios::binary);
+  std::vector<std::uint8_t> stream((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  unsigned threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+  unsigned repeat = argc > 3 ? atoi(argv[3]) : 1;
+
+  asio::io_service io;
+  buffer_pool pool;
+
+  std::uint64_t pictures = 0;
+  std::uint64_t field_pictures = 0;
+  std::uint64_t frames = 0;
+  std::uint64_t failed = 0;
+
+  auto d = mpeg::make_decoder<msvd::software::decoder>(io, frame_source{&pool}, frame_sink{&frames}, threads);
+
+  auto start = clock_type::now();
+
+  for(unsigned n = 0; n != repeat; ++n) {
+    auto first = stream.data();
+    auto last = stream.data() + stream.size();
+
+    // every sequence header and every picture with its extensions is pushed as an access unit
+    for(auto i = mpeg::find_sequence_or_picture_header(first, last); i != last;) {
+      auto next = mpeg::find_sequence_or_picture_header(i + 4, last);
+
+      if(i[3] == mpeg::picture_start_code) {
+        ++pictures;
+
+        auto bits = bitstream::make_bit_parser(bitstream::make_bit_range(utils::make_range(i + 4, next)));
+        mpeg::picture_header(bits);
+        if(u(bits, 32) == (0x00000100 | mpeg::extension_start_code) && u(bits, 4) == mpeg::picture_coding_extension_id
+          && mpeg::picture_coding_extension(bits).picture_structure != mpeg::picture_type::frame)
+          ++field_pictures;
+      }
+
+      push(d, timestamp(pictures), utils::tag<mpeg::access_unit_tag>(utils::make_range<std::uint8_t const*>(i, next)))
+        .then([&](auto f) { try { f.get(); } catch(...) { ++failed; } });
+
+      // picture completions are posted to io, running them lets the frame buffers be reused
+      io.poll();
+      i = next;
+    }
+  }
+
+  io.run();
+
+  std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+  std::cout << pictures << " pictures in " << elapsed.count() << "s, " << pictures / elapsed.count() << " pictures/s" << std::endl;
+  std::cout << "frames output " << frames << " of " << pictures - field_pictures / 2;
+  if(failed) std::cout << ", " << failed << " pictures failed";
+  std::cout << std::endl;
+}
@@ -0,0 +1,141 @@
+// Measures the host side cost of submitting h264 slices through msvd::slice_queue, once
+// with a single slice in flight as the per-slice ioctl and read did and once batched. The
+// device is a loopback over a unix socket pair, so no msvd device is needed; the msvd device
+// itself is kept at one slice in flight until its driver is confirmed to execute in order.
+//
+//   msvd-batch [slices-per-picture] [pictures] [depth]
+
+#include "../msvd.hpp"
+
+#include <chrono>
+#include <iostream>
+
+using clock_type = std::chrono::steady_clock;
+
+// Stand-in for /dev/msvdhd: requests are written to one end of a socket pair and the device
+// end answers each of them with a result holding its sequence number, so the host pays one
+// syscall per request and per reap as with the driver and the order of results can be checked.
+struct loopback_device {
+  loopback_device(asio::io_service& io) : io(io), host(io), dev(io) {
+    asio::local::connect_pair(host, dev);
+    serve();
+  }
+
+  void serve() {
+    dev.async_read_some(asio::buffer(requests), [this](std::error_code const& ec, std::size_t n) {
+      if(ec) return;
+
+      partial += n;
+      results.clear();
+      for(; partial >= sizeof(msvd_h264_decode_params); partial -= sizeof(msvd_h264_decode_params))
+        results.push_back(msvd_decode_result{unsigned(served++)});
+
+      asio::write(dev, asio::buffer(results));
+      serve();
+    });
+  }
+
+  void close() {
+    host.close();
+    dev.close();
+  }
+
+  asio::io_service& io;
+  asio::local::stream_protocol::socket host;
+  asio::local::stream_protocol::socket dev;
+  std::array<std::uint8_t, 64 * 1024> requests;
+  std::vector<msvd_decode_result> results;
+  std::size_t partial = 0;
+  std::uint64_t served = 0;
+  std::uint64_t reaps = 0;
+};
+
+// the request is written at once as the ioctl would be, its completion is posted
+template<typename F>
+void async_submit(loopback_device& d, msvd_h264_decode_params const& params, F callback) {
+  std::error_code ec;
+  asio::write(d.host, asio::buffer(&params, sizeof(params)), ec);
+  d.io.post([callback, ec]() mutable { callback(ec); });
+}
+
+template<typename F>
+void async_reap(loopback_device& d, msvd_decode_result* results, std::size_t n, F callback) {
+  d.host.async_read_some(asio::buffer(results, n * sizeof(msvd_decode_result)), [&d, results, callback](std::error_code ec, std::size_t size) mutable {
+    // the device writes whole results, the rest of a split one is already on its way
+    if(!ec && size % sizeof(msvd_decode_result))
+      size += asio::read(d.host, asio::buffer(reinterpret_cast<std::uint8_t*>(results) + size, sizeof(msvd_decode_result) - size % sizeof(msvd_decode_result)), ec);
+
+    ++d.reaps;
+    callback(ec, size / sizeof(msvd_decode_result));
+  });
+}
+
+// the loopback answers requests in the order they are written
+namespace media { namespace msvd {
+template<>
+struct executes_in_order<loopback_device> : std::true_type {};
+}}
+
+using namespace media;
+
+struct run_result {
+  double seconds;
+  std::uint64_t slices;
+  std::uint64_t reaps;
+  std::uint64_t misordered;
+};
+
+// two pictures are kept in flight, the next one is submitted when all slices of one are done
+run_result run(unsigned slices, unsigned pictures, std::size_t depth) {
+  asio::io_service io;
+  loopback_device device(io);
+  msvd::slice_queue<loopback_device> q(device, depth);
+
+  std::vector<msvd_h264_decode_params> params(slices);
+  std::vector<msvd_decode_result> results(2 * slices);
+  std::uint64_t submitted = 0;
+  std::uint64_t completed = 0;
+  std::uint64_t misordered = 0;
+  unsigned next = 0;
+
+  std::function<void(unsigned)> submit = [&](unsigned slot) {
+    if(next == pictures) return;
+    ++next;
+
+    auto remaining = std::make_shared<unsigned>(slices);
+    for(unsigned i = 0; i != slices; ++i) {
+      auto r = &results[slot * slices + i];
+      auto expected = submitted++;
+
+      async_decode_slice(q, &params[i], r, [&, r, expected, slot, remaining](std::error_code const& ec) {
+        if(ec || r->num_of_decoded_mbs != unsigned(expected)) ++misordered;
+        ++completed;
+        if(--*remaining == 0) submit(slot);
+        if(completed == std::uint64_t(slices) * pictures) device.close();
+      });
+    }
+  };
+
+  auto start = clock_type::now();
+
+  submit(0);
+  submit(1);
+  io.run();
+
+  std::chrono::duration<double> elapsed = clock_type::now() - start;
+  return {elapsed.count(), completed, device.reaps, misordered};
+}
+
+int main(int argc, char* argv[]) {
+  unsigned slices = argc > 1 ? atoi(argv[1]) : 68;
+  unsigned pictures = argc > 2 ? atoi(argv[2]) : 1000;
+  std::size_t depth = argc > 3 ? atoi(argv[3]) : 16;
+
+  for(auto d: {std::size_t(1), depth}) {
+    auto r = run(slices, pictures, d);
+    std::cout << "depth " << d << ": " << r.slices << " slices in " << r.seconds << "s, " << r.slices / r.seconds << " slices/s, "
+      << double(r.slices) / std::max<std::uint64_t>(r.reaps, 1) << " results per read";
+    if(r.misordered) std::cout << ", " << r.misordered << " out of order";
+    std::cout << std::endl;
+  }
+}
@@ -0,0 +1,267 @@
+// Replays a captured transport stream as rtp (pt 33) over loopback with injected loss and
+// repairs it with rtp::retransmission_client, reporting recovery latency and the bandwidth
+// spent on nacks and retransmissions.
+//
+//   rtx-loopback capture.ts [loss-percent] [bitrate-mbps]
+
+#include "../rtp.hpp"
+
+#include <random>
+#include <fstream>
+#include <iostream>
+
+using namespace std::literals::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+const std::size_t ts_per_datagram = 7;
+const unsigned media_pt = 33;
+const unsigned rtx_pt = 97;
+const std::uint32_t media_ssrc = 0x4d454449;
+const std::uint32_t rtx_ssrc = 0x52545853;
+
+// history of sent datagrams indexed by sequence number, shared with the client only to
+// measure how long after the original transmission a repair arrived
+struct history {
+  std::array<std::vector<std::uint8_t>, 1024> packets;
+  std::array<clock_type::time_point, 1024> sent;
+
+  std::vector<std::uint8_t>& packet(std::uint16_t seq) { return packets[seq % packets.size()]; }
+  clock_type::time_point& sent_at(std::uint16_t seq) { return sent[seq % sent.size()]; }
+};
+
+void put_header(std::uint8_t* p, unsigned pt, std::uint16_t seq, std::uint32_t ts, std::uint32_t ssrc) {
+  p[0] = 0x80;
+  p[1] = pt;
+  p[2] = seq >> 8; p[3] = seq;
+  p[4] = ts >> 24; p[5] = ts >> 16; p[6] = ts >> 8; p[7] = ts;
+  p[8] = ssrc >> 24; p[9] = ssrc >> 16; p[10] = ssrc >> 8; p[11] = ssrc;
+}
+
+struct server {
+  server(asio::io_service& io, std::istream& capture, history& h, double loss, double mbps, asio::ip::udp::endpoint media, asio::ip::udp::endpoint rtx) :
+    capture(capture), h(h), loss(loss), socket(io, asio::ip::udp::endpoint(asio::ip::address_v4::loopback(), 0)), rtcp(io, asio::ip::udp::endpoint(asio::ip::address_v4::loopback(), 0)),
+    timer(io), media(media), rtx(rtx), interval(std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(8 * 1328 / (mbps * 1e6))))
+  {}
+
+  void start() {
+    next = clock_type::now();
+    send();
+    receive_nack();
+  }
+
+  void send() {
+    auto& p = h.packet(seq);
+    p.resize(12 + ts_per_datagram * 188);
+    capture.read(reinterpret_cast<char*>(p.data() + 12), ts_per_datagram * 188);
+    if(capture.gcount() != std::streamsize(ts_per_datagram * 188)) {
+      done = true;
+      return;
+    }
+
+    auto now = clock_type::now();
+    put_header(p.data(), media_pt, seq, std::uint32_t(std::chrono::duration_cast<rtp::video_timestamp_t>(now.time_since_epoch()).count()), media_ssrc);
+    h.sent_at(seq) = now;
+
+    if(drop(rng) >= loss) socket.send_to(asio::buffer(p), media);
+    else ++dropped;
+
+    media_bytes += p.size();
+    ++seq;
+
+    next += interval;
+    timer.expires_at(next);
+    timer.async_wait([this](std::error_code const& ec) { if(!ec) send(); });
+  }
+
+  void receive_nack() {
+    rtcp.async_receive(asio::buffer(nack), [this](std::error_code const& ec, std::size_t n) {
+      if(ec) return;
+
+      // generic nack: 12 bytes of header followed by pid/blp entries
+      for(std::size_t i = 12; i + 4 <= n; i += 4) {
+        std::uint16_t pid = (nack[i] << 8) | nack[i+1];
+        std::uint16_t blp = (nack[i+2] << 8) | nack[i+3];
+
+        retransmit(pid);
+        for(unsigned k = 0; k != 16; ++k)
+          if(blp & (1 << k)) retransmit(pid + k + 1);
+      }
+
+      receive_nack();
+    });
+  }
+
+  void retransmit(std::uint16_t osn) {
+    auto const& p = h.packet(osn);
+    if(p.size() < 12 || ((p[2] << 8) | p[3]) != osn) return;
+
+    std::vector<std::uint8_t> r(p.size() + 2);
+    std::memcpy(r.data(), p.data(), 12);
+    put_header(r.data(), rtx_pt, rtx_seq++, (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7], rtx_ssrc);
+    r[12] = osn >> 8; r[13] = osn;
+    std::memcpy(r.data() + 14, p.data() + 12, p.size() - 12);
+
+    if(drop(rng) >= loss) socket.send_to(asio::buffer(r), rtx);
+    ++retransmitted;
+  }
+
+  std::istream& capture;
+  history& h;
+  double loss;
+
+  asio::ip::udp::socket socket;
+  asio::ip::udp::socket rtcp;
+  asio::steady_timer timer;
+  asio::ip::udp::endpoint media;
+  asio::ip::udp::endpoint rtx;
+
+  clock_type::duration interval;
+  clock_type::time_point next;
+
+  std::mt19937 rng{1};
+  std::uniform_real_distribution<double> drop{0, 1};
+  std::array<std::uint8_t, 1500> nack;
+
+  std::uint16_t seq = 0;
+  std::uint16_t rtx_seq = 0;
+  std::uint64_t media_bytes = 0;
+  std::uint64_t dropped = 0;
+  std::uint64_t retransmitted = 0;
+  bool done = false;
+};
+
+struct client {
+  client(asio::io_service& io, history& h) :
+    h(h), media(io, asio::ip::udp::endpoint(asio::ip::address_v4::loopback(), 0)), rtx(io, asio::ip::udp::endpoint(asio::ip::address_v4::loopback(), 0)),
+    rtcp(io), timer(io), rtx_client(0x434c4e54), jb(20ms, 200ms)
+  {
+    media.non_blocking(true);
+    rtx.non_blocking(true);
+    rtcp.open(asio::ip::udp::v4());
+  }
+
+  void start(asio::ip::udp::endpoint server_rtcp) {
+    rtcp_endpoint = server_rtcp;
+
+    rtp::async_receive(media, media_packets, [this](std::error_code const& ec, std::size_t n) {
+      if(ec) return report(ec);
+
+      auto now = clock_type::now();
+      for(std::size_t i = 0; i != n; ++i) {
+        auto p = rtp::rtp_packet::parse(std::move(media_packets[i]));
+        rtx_client.received(p, now);
+        jb.push(std::move(p), now);
+      }
+    });
+
+    rtp::async_receive(rtx, rtx_packets, [this](std::error_code const& ec, std::size_t n) {
+      if(ec) return report(ec);
+
+      auto now = clock_type::now();
+      for(std::size_t i = 0; i != n; ++i) {
+        auto p = rtx_client.repair(rtp::rtp_packet::parse(std::move(rtx_packets[i])));
+        if(p.empty()) continue;
+
+        auto latency = now - h.sent_at(p.sequence_number());
+        total_latency += latency;
+        max_latency = std::max(max_latency, latency);
+        ++repairs;
+
+        jb.repair(std::move(p), now);
+      }
+    });
+
+    tick();
+  }
+
+  void tick() {
+    auto now = clock_type::now();
+
+    auto nack = rtx_client.poll(now);
+    if(asio::buffer_size(nack)) rtcp.send_to(asio::const_buffers_1(nack), rtcp_endpoint);
+
+    while(!jb.pop(now).empty());
+
+    timer.expires_from_now(1ms);
+    timer.async_wait([this](std::error_code const& ec) { if(!ec) tick(); });
+  }
+
+  // closing the sockets at the end of the run cancels the receives, anything else is reported
+  void report(std::error_code const& ec) {
+    if(ec != asio::error::operation_aborted) std::cerr << "receive failed: " << ec.message() << std::endl;
+  }
+
+  void stop() {
+    media.close();
+    rtx.close();
+    timer.cancel();
+  }
+
+  history& h;
+  asio::ip::udp::socket media;
+  asio::ip::udp::socket rtx;
+  asio::ip::udp::socket rtcp;
+  asio::ip::udp::endpoint rtcp_endpoint;
+  asio::steady_timer timer;
+
+  rtp::retransmission_client<> rtx_client;
+  rtp::jitter_buffer<> jb;
+
+  std::array<rtp::udp_packet, 32> media_packets;
+  std::array<rtp::udp_packet, 32> rtx_packets;
+
+  clock_type::duration total_latency{0};
+  clock_type::duration max_latency{0};
+  std::uint64_t repairs = 0;
+};
+
+int main(int argc, char* argv[]) {
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0] << " capture.ts [loss-percent] [bitrate-mbps]" << std::endl;
+    return 1;
+  }
+
+  std::ifstream capture(argv[1], std::ios::binary);
+  auto loss = argc > 2 ? atof(argv[2]) / 100 : 0.01;
+  auto mbps = argc > 3 ? atof(argv[3]) : 10;
+
+  asio::io_service io;
+  history h;
+
+  client c(io, h);
+  server s(io, capture, h, loss, mbps, c.media.local_endpoint(), c.rtx.local_endpoint());
+
+  c.start(s.rtcp.local_endpoint());
+  s.start();
+
+  asio::steady_timer done(io);
+  std::function<void(std::error_code const&)> wait_done = [&](std::error_code const&) {
+    if(!s.done) {
+      done.expires_from_now(100ms);
+      done.async_wait(wait_done);
+      return;
+    }
+
+    // give the last repairs and the jitter buffer time to drain
+    done.expires_from_now(500ms);
+    done.async_wait([&](std::error_code const&) {
+      c.stop();
+      s.rtcp.close();
+    });
+  };
+  wait_done({});
+
+  io.run();
+
+  auto const& rs = stats(c.rtx_client);
+  auto const& js = stats(c.jb);
+  auto us = [](clock_type::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+
+  std::cout << "sent " << s.seq << " packets, " << s.media_bytes << " bytes, dropped " << s.dropped << std::endl;
+  std::cout << "nacks " << rs.nacks << ", requested " << rs.requested << ", repaired " << rs.repaired
+    << ", abandoned " << rs.abandoned << ", retransmitted " << s.retransmitted << std::endl;
+  std::cout << "jitter buffer: released " << js.released << ", lost " << js.lost << ", late " << js.late << std::endl;
+  std::cout << "recovery latency: mean " << (c.repairs ? us(c.total_latency) / std::int64_t(c.repairs) : 0) << "us, max " << us(c.max_latency) << "us" << std::endl;
+  std::cout << "overhead: rtcp " << rs.rtcp_bytes << " bytes, rtx " << rs.rtx_bytes << " bytes, "
+    << 100.0 * (rs.rtcp_bytes + rs.rtx_bytes) / std::max<std::uint64_t>(s.media_bytes, 1) << "%" << std::endl;
+}
@@ -0,0 +1,77 @@
+// Feeds psi::section_assembler with packet payloads where sections end and start in the
+// same packet.
+
+#include "../ts.hpp"
+
+#include <cassert>
+#include <iostream>
+
+using namespace media::mpeg::ts;
+
+// a section of n bytes including the header and CRC_32
+std::vector<std::uint8_t> make_section(std::uint8_t table_id, std::size_t n) {
+  std::vector<std::uint8_t> s(n);
+  s[0] = table_id;
+  s[1] = 0xB0;
+  for(std::size_t i = 3; i != n - 4; ++i) s[i] = std::uint8_t(i);
+  psi::finish_section(&s[0], &s[0] + n - 4);
+  return s;
+}
+
+// payload of a packet starting with pointer_field, the rest is stuffed with 0xFF
+std::vector<std::uint8_t> payload(std::vector<std::uint8_t> const& tail, std::vector<std::uint8_t> const& start, std::size_t n = 184) {
+  std::vector<std::uint8_t> p{std::uint8_t(tail.size())};
+  p.insert(p.end(), tail.begin(), tail.end());
+  p.insert(p.end(), start.begin(), start.end());
+  p.resize(n, 0xFF);
+  return p;
+}
+
+bool equal(utils::optional<utils::range<std::uint8_t const*>> const& r, std::vector<std::uint8_t> const& s) {
+  return r && std::size_t(end(*r) - begin(*r)) == s.size() && std::equal(begin(*r), end(*r), s.begin());
+}
+
+int main() {
+  auto a = make_section(0x02, 250);
+  auto b = make_section(0x02, 40);
+  auto c = make_section(0x02, 200);
+  auto d = make_section(0x02, 30);
+
+  psi::section_assembler assembler;
+
+  // a starts at the beginning of the first packet and ends in the second one
+  auto p = payload({}, std::vector<std::uint8_t>(a.begin(), a.begin() + 183));
+  assert(!assembler(true, p.begin(), p.end()));
+
+  // the rest of a is followed by all of b and d
+  auto bd = b;
+  bd.insert(bd.end(), d.begin(), d.end());
+  p = payload(std::vector<std::uint8_t>(a.begin() + 183, a.end()), bd);
+  assert(equal(assembler(true, p.begin(), p.end()), a));
+  assert(equal(assembler.next(), b));
+  assert(equal(assembler.next(), d));
+  assert(!assembler.next());
+
+  // b and d start in a short payload, d continues in the next packet
+  p = payload({}, std::vector<std::uint8_t>(bd.begin(), bd.begin() + 60), 61);
+  assert(equal(assembler(true, p.begin(), p.end()), b));
+  assert(!assembler.next());
+  p.assign(bd.begin() + 60, bd.end());
+  assert(equal(assembler(false, p.begin(), p.end()), d));
+  assert(!assembler.next());
+
+  // the next packet starts c without a pointer into a previous section
+  p = payload({}, std::vector<std::uint8_t>(c.begin(), c.begin() + 183));
+  assert(!assembler(true, p.begin(), p.end()));
+
+  // the rest of c in a packet that starts a, which continues in the packet after it
+  p = payload(std::vector<std::uint8_t>(c.begin() + 183, c.end()), std::vector<std::uint8_t>(a.begin(), a.begin() + 166));
+  assert(equal(assembler(true, p.begin(), p.end()), c));
+  assert(!assembler.next());
+
+  p.assign(a.begin() + 166, a.end());
+  assert(equal(assembler(false, p.begin(), p.end()), a));
+  assert(!assembler.next());
+
+  std::cout << "ok" << std::endl;
+}
@@ -1,6 +1,10 @@
 #ifndef __transport_stream_hpp_aac2597c_3f6a_406f_9316_8357a47b03f2__
 #define __transport_stream_hpp_aac2597c_3f6a_406f_9316_8357a47b03f2__
 
+#include <bitset>
+#include <cstdlib>
+#include <unistd.h>
+
 #include "utils.hpp"
 #include "bitstream.hpp"
 
@@ -385,6 +389,336 @@ demuxer<buffered_reader<Source, 100>, sizeof...(Pids)> make_demuxer(Source src,
   return demuxer<buffered_reader<Source, 100>, sizeof...(Pids)>(std::move(src), a);
 }
 
+// 2.4.4 Program specific information
+namespace psi {
+
+const unsigned pat_pid = 0;
+const std::size_t max_section_length = 1021;
+
+inline
+std::uint32_t crc32(std::uint8_t const* first, std::uint8_t const* last) {
+  static const auto table = [] {
+    std::array<std::uint32_t, 256> t;
+    for(std::uint32_t i = 0; i != t.size(); ++i) {
+      auto c = i << 24;
+      for(int k = 0; k != 8; ++k)
+        c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : (c << 1);
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  std::uint32_t crc = 0xFFFFFFFF;
+  for(; first != last; ++first)
+    crc = (crc << 8) ^ table[(crc >> 24) ^ *first];
+  return crc;
+}
+
+inline std::size_t section_length(std::uint8_t const* s) { return ((s[1] & 0x0F) << 8) | s[2]; }
+inline unsigned version_number(std::uint8_t const* s) { return (s[5] >> 1) & 0x1F; }
+
+inline
+void set_section_length(std::uint8_t* s, std::size_t n) {
+  s[1] = (s[1] & 0xF0) | ((n >> 8) & 0x0F);
+  s[2] = n & 0xFF;
+}
+
+// appends CRC_32 to the section and fixes up section_length, returns the section end
+inline
+std::uint8_t* finish_section(std::uint8_t* first, std::uint8_t* last) {
+  set_section_length(first, last - first + 4 - 3);
+  auto crc = crc32(first, last);
+  *last++ = crc >> 24;
+  *last++ = crc >> 16;
+  *last++ = crc >> 8;
+  *last++ = crc;
+  return last;
+}
+
+// collects sections from the payloads of ts packets carrying them, a packet that ends one
+// section and starts more yields the first one and next() then yields the following ones that
+// are complete, up to the stuffing bytes. The sections returned stay valid until the next packet.
+struct section_assembler {
+  std::vector<std::uint8_t> buffer;
+  std::vector<std::uint8_t> finished;
+  std::size_t start = 0;  // where the section being collected begins in buffer
+  bool in_progress = false;
+
+  bool complete() const { return buffer.size() - start >= 3 && buffer.size() - start >= 3 + section_length(&buffer[start]); }
+
+  template<typename I>
+  utils::optional<utils::range<std::uint8_t const*>> operator()(bool payload_unit_start_indicator, I first, I last) {
+    if(first == last) return utils::nullopt;
+
+    // the sections returned for the previous packet are dropped
+    buffer.erase(buffer.begin(), buffer.begin() + start);
+    start = 0;
+
+    if(payload_unit_start_indicator) {
+      auto pointer_field = *first++;
+      bool ended = false;
+      if(in_progress && pointer_field <= last - first) {
+        buffer.insert(buffer.end(), first, first + pointer_field);
+        ended = complete();
+      }
+
+      if(pointer_field > last - first) {
+        in_progress = false;
+        return utils::nullopt;
+      }
+
+      // the previous section is kept aside while the new ones are collected
+      if(ended) finished.swap(buffer);
+
+      std::advance(first, pointer_field);
+      buffer.assign(first, last);
+      in_progress = true;
+
+      if(ended) {
+        auto s = section(finished, 0);
+        if(s) return s;
+      }
+    }
+    else {
+      if(!in_progress) return utils::nullopt;
+      buffer.insert(buffer.end(), first, last);
+    }
+
+    return next();
+  }
+
+  // the next complete section in the buffer, sections with a wrong length or CRC_32 are skipped
+  utils::optional<utils::range<std::uint8_t const*>> next() {
+    while(in_progress && start != buffer.size() && buffer[start] != 0xFF && complete()) {
+      auto s = section(buffer, start);
+      start += 3 + section_length(&buffer[start]);
+      if(s) return s;
+    }
+
+    // a section ending the payload or followed by stuffing is the last one of the packet
+    if(start == buffer.size() || buffer[start] == 0xFF) in_progress = false;
+    return utils::nullopt;
+  }
+
+private:
+  static utils::optional<utils::range<std::uint8_t const*>> section(std::vector<std::uint8_t> const& b, std::size_t start) {
+    auto n = 3 + section_length(&b[start]);
+    if(n < 12 || n > 3 + max_section_length || crc32(&b[start], &b[start] + n) != 0) return utils::nullopt;
+    return utils::make_range<std::uint8_t const*>(&b[start], &b[start] + n);
+  }
+};
+
+} // namespace psi
+
+// writes an aligned ts packet block to a file descriptor
+struct file_sink {
+  int fd;
+
+  void operator()(asio::const_buffer const& b) const {
+    auto p = asio::buffer_cast<std::uint8_t const*>(b);
+    auto n = asio::buffer_size(b);
+    while(n) {
+      auto r = ::write(fd, p, n);
+      if(r < 0 && errno == EINTR) continue;
+      if(r < 0) throw std::system_error(errno, std::system_category());
+      p += r;
+      n -= r;
+    }
+  }
+};
+
+// Rewrites a single program of the input transport stream: passes the selected elementary
+// streams (all streams of the program if none are selected) and the PCR PID, regenerates
+// PAT and PMT for that program on every input PAT, and renumbers continuity counters.
+// Output is staged in a page aligned block of N packets which is handed to the sink in one
+// piece; the default of 1024 packets is exactly 47 pages.
+template<typename Sink, std::size_t N = 1024>
+struct remuxer {
+  remuxer(Sink sink, unsigned program_number, std::vector<unsigned> pids = {}) :
+    sink(std::move(sink)), program_number(program_number), selected_pids(std::move(pids)),
+    block(allocate_block(), &std::free)
+  {
+    in_cc.fill(0xFF);
+    out_cc.fill(0);
+  }
+
+  remuxer(remuxer&&) = default;
+
+  ~remuxer() {
+    try { flush(); } catch(...) {}
+  }
+
+  template<typename BS>
+  void operator()(ts::packet<BS> const& p) {
+    auto i = begin(p);
+
+    if(i[0] != sync_byte) throw std::system_error(make_error_code(errc::out_of_sync));
+
+    bool payload_unit_start_indicator = i[1] & 0x40;
+    unsigned pid = ((i[1] & 0x1F) << 8) | i[2];
+    unsigned adaptation_field_control = (i[3] >> 4) & 0x3;
+    unsigned continuity_counter = i[3] & 0xF;
+
+    if(pid == psi::pat_pid || pid == pmt_pid) {
+      auto first = i + 4;
+      if(adaptation_field_control == 3) first += 1 + first[0];
+      if(adaptation_field_control == 2 || adaptation_field_control == 0 || first >= end(p)) return;
+
+      if(pid == psi::pat_pid) {
+        for(auto s = pat_assembler(payload_unit_start_indicator, first, end(p)); s; s = pat_assembler.next())
+          on_pat(begin(*s), end(*s));
+      }
+      else {
+        for(auto s = pmt_assembler(payload_unit_start_indicator, first, end(p)); s; s = pmt_assembler.next())
+          on_pmt(begin(*s), end(*s));
+      }
+      return;
+    }
+
+    if(!pmt || !passed[pid]) return;
+
+    if(adaptation_field_control & 1) {
+      if(in_cc[pid] == continuity_counter) return; // duplicate packet
+      in_cc[pid] = continuity_counter;
+      out_cc[pid] = (out_cc[pid] + 1) & 0xF;
+    }
+
+    auto o = next_packet();
+    std::copy(i, i + packet_length, o);
+    o[3] = (o[3] & 0xF0) | out_cc[pid];
+  }
+
+  void flush() {
+    if(fill == 0 || !block) return;
+    sink(asio::const_buffer(block.get(), fill));
+    fill = 0;
+  }
+
+private:
+  static std::uint8_t* allocate_block() {
+    void* p = nullptr;
+    if(posix_memalign(&p, 4096, N*packet_length)) throw std::bad_alloc();
+    return static_cast<std::uint8_t*>(p);
+  }
+
+  std::uint8_t* next_packet() {
+    if(fill == N*packet_length) flush();
+    auto p = block.get() + fill;
+    fill += packet_length;
+    return p;
+  }
+
+  template<typename I>
+  void on_pat(I first, I last) {
+    if(first[0] != 0x00) return;
+    transport_stream_id = (first[3] << 8) | first[4];
+
+    for(auto i = first + 8; i + 4 <= last - 4; i += 4) {
+      unsigned n = (i[0] << 8) | i[1];
+      unsigned pid = ((i[2] & 0x1F) << 8) | i[3];
+      if(n == program_number) {
+        if(pid != pmt_pid) {
+          pmt_pid = pid;
+          pmt = utils::nullopt;
+        }
+        write_psi();
+        return;
+      }
+    }
+  }
+
+  template<typename I>
+  void on_pmt(I first, I last) {
+    if(first[0] != 0x02 || unsigned((first[3] << 8) | first[4]) != program_number) return;
+    if(pmt && pmt->size() >= 6 && psi::version_number(&(*pmt)[0]) == psi::version_number(&*first)) return;
+
+    unsigned pcr_pid = ((first[8] & 0x1F) << 8) | first[9];
+    std::size_t program_info_length = ((first[10] & 0x0F) << 8) | first[11];
+    if(12 + program_info_length > std::size_t(last - first) - 4) return;
+
+    std::vector<std::uint8_t> s(first, first + 12 + program_info_length);
+    s.reserve(3 + psi::max_section_length);
+
+    passed.reset();
+    passed[pcr_pid] = true;
+
+    for(auto i = first + 12 + program_info_length; i + 5 <= last - 4;) {
+      unsigned pid = ((i[1] & 0x1F) << 8) | i[2];
+      std::size_t es_info_length = ((i[3] & 0x0F) << 8) | i[4];
+      if(i + 5 + es_info_length > last - 4) break;
+      
+      if(selected_pids.empty() || std::find(selected_pids.begin(), selected_pids.end(), pid) != selected_pids.end()) {
+        s.insert(s.end(), i, i + 5 + es_info_length);
+        passed[pid] = true;
+      }
+      i += 5 + es_info_length;
+    }
+
+    s.resize(s.size() + 4);
+    psi::finish_section(&s[0], &s[0] + s.size() - 4);
+    pmt = std::move(s);
+
+    write_psi();
+  }
+
+  void write_section(unsigned pid, std::uint8_t const* first, std::uint8_t const* last) {
+    bool start = true;
+    while(first != last || start) {
+      auto o = next_packet();
+      o[0] = sync_byte;
+      o[1] = (start ? 0x40 : 0) | ((pid >> 8) & 0x1F);
+      o[2] = pid & 0xFF;
+      out_cc[pid] = (out_cc[pid] + 1) & 0xF;
+      o[3] = 0x10 | out_cc[pid];
+
+      auto p = o + 4;
+      if(start) *p++ = 0; // pointer_field
+      auto n = std::min<std::size_t>(last - first, o + packet_length - p);
+      p = std::copy(first, first + n, p);
+      std::fill(p, o + packet_length, 0xFF);
+
+      first += n;
+      start = false;
+    }
+  }
+
+  void write_psi() {
+    std::uint8_t pat[16] = {
+      0x00, 0xB0, 0x00, 
+      std::uint8_t(transport_stream_id >> 8), std::uint8_t(transport_stream_id),
+      0xC1, 0x00, 0x00,
+      std::uint8_t(program_number >> 8), std::uint8_t(program_number),
+      std::uint8_t(0xE0 | (pmt_pid >> 8)), std::uint8_t(pmt_pid)
+    };
+    write_section(psi::pat_pid, pat, psi::finish_section(pat, pat + 12));
+
+    if(pmt) write_section(pmt_pid, &(*pmt)[0], &(*pmt)[0] + pmt->size());
+  }
+
+  Sink sink;
+  unsigned program_number;
+  std::vector<unsigned> selected_pids;
+
+  unsigned transport_stream_id = 0;
+  unsigned pmt_pid = 0x2000; // unknown until the first PAT
+  utils::optional<std::vector<std::uint8_t>> pmt;
+
+  psi::section_assembler pat_assembler;
+  psi::section_assembler pmt_assembler;
+
+  std::bitset<8192> passed;
+  std::array<std::uint8_t, 8192> in_cc;
+  std::array<std::uint8_t, 8192> out_cc;
+
+  std::unique_ptr<std::uint8_t, decltype(&std::free)> block;
+  std::size_t fill = 0;
+};
+
+template<typename Sink>
+remuxer<Sink> make_remuxer(Sink sink, unsigned program_number, std::vector<unsigned> pids = {}) {
+  return remuxer<Sink>(std::move(sink), program_number, std::move(pids));
+}
+
 } // namespace ts
 
 }}